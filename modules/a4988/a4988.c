@@ -1,264 +1,2305 @@
 #include <linux/init.h>
 #include <linux/module.h>
+#include <linux/moduleparam.h>
 #include <linux/fs.h>
+#include <linux/cdev.h>
+#include <linux/kref.h>
 #include <linux/device.h>
+#include <linux/platform_device.h>
+#include <linux/of.h>
+#include <linux/of_gpio.h>
 #include <linux/gpio.h>
+#include <linux/slab.h>
 #include <linux/string.h>
-#include <linux/delay.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+#include <linux/kfifo.h>
+#include <linux/poll.h>
+#include <linux/uaccess.h>
+#include <linux/io.h>
+#include <linux/firmware.h>
+#include <linux/pwm.h>
+#include <linux/interrupt.h>
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/log2.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <asm/div64.h>
+
+#include "a4988.h"
+#include "am335x_gpio.h"
+#include "am335x_ehrpwm.h"
+#include "dagu_encoder.h"
 
 #define DRVNAME "A4988"
-#define DIR_SIZE 4
 
+//driver needs device tree entries in order to work, overlay need to be loaded
+
+/* steps per second; A4988 needs at least 1us high and 1us low on STEP,
+ * the limit leaves margin for hrtimer latency */
+#define SPEED_DEFAULT 250
+#define SPEED_MAX 50000
+#define PRU_SPEED_MAX 200000
+/* every PWM pulse costs one short interrupt to count it */
+#define PWM_SPEED_MAX 100000
+/* steps/s^2 and steps/s^3, 0 disables ramping and S-curve respectively */
+#define ACCEL_MAX 1000000
+#define JERK_MAX 100000000
+/* longest acceleration ramp in steps, the rest of the way up to
+ * speed is skipped when it does not fit */
+#define RAMP_MAX 4096
+/* queued segments and lines, must be powers of 2 */
+#define QUEUE_LEN 256
+#define LINE_QUEUE_LEN 64
+/* moves copied from userspace at once */
+#define WRITE_BATCH 16
+
+/* indexes in a4988.pins, the devicetree names them "<pins_names>-gpio" */
 #define PINS_AMOUNT 8
+#define ENABLE_PIN 0
+#define MS1_PIN 1
+#define MS2_PIN 2
+#define MS3_PIN 3
+#define RESET_PIN 4
+#define SLEEP_PIN 5
+#define STEP_PIN 6
+#define DIR_PIN 7
+
+/* PRU-ICSS, pru/a4988 firmware; addresses for pru0, pru1 at PRU1_OFFSET */
+#define PRUSS_BASE 0x4a300000
+#define PRU_DRAM 0x00000
+#define PRU_CTRL 0x22000
+#define PRU_IRAM 0x34000
+#define PRU_DRAM_OFFSET 0x2000
+#define PRU_CTRL_OFFSET 0x2000
+#define PRU_IRAM_OFFSET 0x4000
+#define PRU_RAM_SIZE 0x2000
+#define PRU_CTRL_RESET 0
+#define PRU_CTRL_DISABLE 1
+#define PRU_CTRL_ENABLE 2
+#define PRU_FIRMWARE "a4988-pru.bin"
+/* ring layout shared with a4988.p */
+#define PRU_RING_HEAD 0x00
+#define PRU_RING_TAIL 0x04
+#define PRU_RING_POSITION 0x08
+#define PRU_RING_BASE 0x10
+#define PRU_RING_LEN 256
+#define PRU_ENTRY_SIZE 16
+/* firmware delay loop length and the instructions around each edge, in loops */
+#define PRU_NS_PER_LOOP 10
+#define PRU_HIGH_OVERHEAD 1
+#define PRU_LOW_OVERHEAD 4
+/* how often the ring is refilled, it holds at least this long of steps
+ * at PRU_SPEED_MAX once the ramp is over */
+#define PRU_REFILL_NS 500000
+
+/* automatic microstepping: the translator repeats every 4 full steps,
+ * PHASE_CYCLE is that in 1/A4988_USTEP_MAX steps */
+#define PHASE_CYCLE (4 * A4988_USTEP_MAX)
+#define AUTO_MODES 4
+
+/* closed loop defaults: a 192 edge dagu wheel encoder on a 200 step motor,
+ * loss reported 4 full steps behind; a move is retried at most
+ * LOSS_RETRIES times in a row */
+#define ENC_COUNTS_DEFAULT 192
+#define ENC_STEPS_DEFAULT 200
+#define LOSS_TOLERANCE_DEFAULT (4 * A4988_USTEP_MAX)
+#define LOSS_RETRIES 3
+
+/* step edge lateness histogram, JITTER_BUCKET_NS wide buckets and the
+ * last one collecting everything beyond */
+#define JITTER_BUCKET_NS 1000
+#define JITTER_BUCKETS 128
+
+/* what steps_store() does when a move is already running */
+enum step_policy {
+	POLICY_REJECT,	/* fail with -EBUSY */
+	POLICY_QUEUE,	/* append it to the segment queue */
+};
+
+/* what the closed loop does when the encoder falls behind */
+enum loss_action {
+	LOSS_REPORT,	/* count and notify, keep going */
+	LOSS_STOP,	/* also stop, correct the position and lower accel */
+	LOSS_RETRY,	/* also move again to where the queue was going */
+};
+
+/* a queued move with its rate already converted to a step interval */
+struct step_segment {
+	u32 steps;
+	u32 interval;	/* ns, 0 - use the ramp */
+	u8 dir;
+	u8 ustep;	/* 0 - automatic, steps in 1/A4988_USTEP_MAX */
+};
+
+/* how late the step edges come out against the planned times */
+struct jitter {
+	spinlock_t lock;
+	u32 hist[JITTER_BUCKETS];
+	u64 count, sum;
+	u32 min, max;
+	u32 overruns;	/* edges late by a whole interval or more, steps squeezed */
+};
+
+/* one stepper axis, described by an "allegro,a4988" devicetree node;
+ * probe and every open file hold a reference, gone is set under
+ * step_mutex once remove has stopped it */
+struct a4988 {
+	int id;
+	int pins[PINS_AMOUNT];
+	int pru;	/* PRU core generating the steps, -1 for the hrtimer */
+	struct device *dev;
+	struct cdev *cdev;
+	struct kref ref;
+	int gone;
+	struct mutex step_mutex;
+
+	unsigned int enable, sleep, reset, ustep, steps;
+	unsigned int speed, accel, jerk;
+	/* with ustep_auto planned moves are in 1/A4988_USTEP_MAX steps and
+	 * the mode coarsens as the velocity crosses auto_threshold[] */
+	int ustep_auto;
+	unsigned int auto_threshold[AUTO_MODES];
+	u32 auto_interval[AUTO_MODES];
+	enum step_policy policy;
+	int dir;
+	/* position in 1/A4988_USTEP_MAX steps, updated as the steps go out;
+	 * queued_position is where the queue ends, valid while busy */
+	atomic64_t position;
+	s64 queued_position;
+
+	/* step intervals in ns while accelerating from standstill, the last
+	 * entry is the cruise interval; rebuilt by build_ramp() only while idle */
+	u32 ramp[RAMP_MAX];
+	unsigned int ramp_len;
+
+	/* step generator state, touched by step_timer_func() while busy */
+	struct hrtimer timer;
+	u32 seg_interval;
+	int step_inc;
+	unsigned int step_index;
+	u32 step_low;
+	int step_level;
+	int seg_auto;
+	unsigned int step_unit;	/* 1/A4988_USTEP_MAX steps per step in auto segments, else 1 */
+	unsigned int phase;	/* translator position, 1/A4988_USTEP_MAX steps from home */
+	int busy;
+	wait_queue_head_t wait;
+	struct work_struct busy_work;
+	struct jitter jitter;
+	struct dentry *debugfs;
+	/* segments waiting for the generator, filled under step_mutex and
+	 * drained by the timer; queue_lock orders the last pop against busy */
+	DECLARE_KFIFO(queue, struct step_segment, QUEUE_LEN);
+	spinlock_t queue_lock;
+
+	/* closed loop over dagu encoder channel encoder, -1 - open loop;
+	 * enc_scale is 1/A4988_USTEP_MAX steps per edge in 16.16 fixed point.
+	 * Every segment starts a new baseline, travel is the distance
+	 * commanded since then and loss_error how far the encoder lags. */
+	int encoder;
+	unsigned long long (*encoder_edges)(int channel);
+	unsigned int enc_counts, enc_steps;
+	u32 enc_scale;
+	unsigned int loss_tolerance;
+	enum loss_action loss_action;
+	unsigned int loss_count, retries;
+	int loss_stopped;
+	u64 enc_base, travel;
+	s64 pos_base, loss_target;
+	int loss_error, loss_last;
+	struct work_struct loss_work;
+
+	/* PWM backend, STEP comes from PWM pwm_id and step-gpio, wired to the
+	 * same net, counts the pulses; edges and target run from probe. With
+	 * pwm_stopping the interrupt forces the output low at pwm_target. */
+	int pwm_id;
+	struct pwm_device *pwm;
+	void __iomem *pwm_regs;
+	struct task_struct *pwm_task;
+	wait_queue_head_t pwm_wait;
+	atomic_t pwm_edges;
+	u32 pwm_target, pwm_period;
+	int pwm_on, pwm_stopping;
+
+	/* PRU backend, pru_head is the next ring entry the ARM writes */
+	void __iomem *pru_ram;
+	void __iomem *pru_ctrl;
+	u32 pru_head;
+	u32 pru_position;
+};
+
+/* a queued coordinated move, steps are signed per axis id */
+struct line_segment {
+	s32 steps[A4988_AXES_MAX];
+	u32 interval;	/* ns per step of the longest axis */
+};
+
+static struct class *a4988_class;
+static dev_t a4988_devt;	/* minors 0..A4988_AXES_MAX - 1 for axes, then the line device */
+
+/* probed axes by id, the coordinator addresses them this way */
+static struct a4988 *axes[A4988_AXES_MAX];
+static DEFINE_MUTEX(axes_mutex);
 
-#define ENABLE_PIN 67
-#define MS1_PIN 68
-#define MS2_PIN 44
-#define MS3_PIN 26
-#define RESET_PIN 46
-#define SLEEP_PIN 65
-#define STEP_PIN 61
-#define DIR_PIN 88
+/* coordinator state; while line_busy the axes in line_axes are claimed,
+ * their busy flag is set and their own generators stay stopped */
+static struct device *line_dev;
+static struct cdev line_cdev;
+static DEFINE_MUTEX(line_mutex);
+static DEFINE_SPINLOCK(line_lock);
+static DECLARE_WAIT_QUEUE_HEAD(line_wait);
+static DECLARE_KFIFO(line_queue, struct line_segment, LINE_QUEUE_LEN);
+static struct hrtimer line_timer;
+static struct a4988 *line_axes[A4988_AXES_MAX];
+static u32 line_delta[A4988_AXES_MAX], line_err[A4988_AXES_MAX];
+static u32 line_major, line_count, line_interval, line_stepped;
+static int line_level, line_busy;
+static void line_notify(struct work_struct *work);
+static DECLARE_WORK(line_work, line_notify);
+static struct jitter line_jitter;
+
+static struct dentry *a4988_debugfs;
+
+/* STEP, DIR and MS pins written to the GPIO bank registers instead of
+ * through gpiolib, MS pins sharing a bank then change in one store */
+static bool direct_gpio;
+module_param(direct_gpio, bool, S_IRUGO);
+MODULE_PARM_DESC(direct_gpio, "write step, dir and ms pins to the AM335x GPIO registers");
+static struct am335x_gpio gpio_regs;
+
+/* keeps the step rate of every mode under 8000 steps/s */
+static const unsigned int auto_threshold_default[AUTO_MODES] = {8000, 16000, 32000, 64000};
+
+int pins_init_val[] = {0, 0, 0, 0, 1, 1, 0, 0};
+char *pins_names[] = {"enable", "ms1", "ms2", "ms3", "reset", "sleep", "step", "dir"};
+
+static inline void pin_set(struct a4988 *ax, int pin, int value)
+{
+	if(direct_gpio)am335x_gpio_set(&gpio_regs, ax->pins[pin], value);
+	else gpio_set_value(ax->pins[pin], value);
+}
+
+/* MS3, MS2, MS1 levels for 1, 2, 4, 8 and 16 microsteps */
+static const u8 ustep_ms[] = {0x0, 0x1, 0x2, 0x3, 0x7};
+
+static int set_ustep_pins(struct a4988 *ax, unsigned int u)
+{
+	u32 mask[AM335X_GPIO_BANKS] = {0}, value[AM335X_GPIO_BANKS] = {0};
+	int i, b, ms;
+
+	if(u == 0 || u > A4988_USTEP_MAX || (u & (u - 1)))return -EINVAL;
+	ms = ustep_ms[ilog2(u)];
+	if(!direct_gpio){
+		for(i = 0; i < 3; i++)gpio_set_value(ax->pins[MS1_PIN + i], (ms >> i) & 1);
+		return 0;
+	}
+	/* no invalid mode in between when the three pins share a bank */
+	for(i = 0; i < 3; i++){
+		b = AM335X_GPIO_BANK(ax->pins[MS1_PIN + i]);
+		mask[b] |= AM335X_GPIO_BIT(ax->pins[MS1_PIN + i]);
+		if((ms >> i) & 1)value[b] |= AM335X_GPIO_BIT(ax->pins[MS1_PIN + i]);
+	}
+	for(b = 0; b < AM335X_GPIO_BANKS; b++)
+		if(mask[b])am335x_gpio_write(&gpio_regs, b, mask[b], value[b]);
+	return 0;
+}
+
+static u64 isqrt64(u64 x)
+{
+	u64 r = 0, b = 1ULL << 62;
+	while(b > x)b >>= 2;
+	while(b){
+		if(x >= r + b){
+			x -= r + b;
+			r = (r >> 1) + b;
+		}
+		else r >>= 1;
+		b >>= 2;
+	}
+	return r;
+}
 
-DEFINE_MUTEX(step_mutex);
+static u64 icbrt64(u64 x)
+{
+	u64 y = 0, b;
+	int s;
+	for(s = 63; s >= 0; s -= 3){
+		y <<= 1;
+		b = 3 * y * (y + 1) + 1;
+		if((x >> s) >= b){
+			x -= b << s;
+			y++;
+		}
+	}
+	return y;
+}
+
+/* motion planner
+ * integrates the profile step by step: velocity in millisteps/s and
+ * acceleration in millisteps/s^2, time in ns. With jerk set the
+ * acceleration rises and falls linearly (S-curve), otherwise it is
+ * constant (trapezoid). Deceleration mirrors the table, so the timer
+ * only has to index it. Called with step_mutex held and no move running. */
+static void build_ramp(struct a4988 *ax)
+{
+	u64 v = 0, a, a_prev, da, dt, v_max, a_max, cruise;
+	unsigned int i;
+
+	cruise = NSEC_PER_SEC / ax->speed;
+	if(ax->accel == 0){
+		ax->ramp[0] = cruise;
+		ax->ramp_len = 1;
+		return;
+	}
+	v_max = (u64)ax->speed * 1000;
+	a_max = (u64)ax->accel * 1000;
+	/* the first step starts from standstill: s = a*t^2/2, or s = j*t^3/6 */
+	if(ax->jerk == 0){
+		a = a_max;
+		dt = isqrt64(div64_u64(2 * (u64)NSEC_PER_SEC * NSEC_PER_SEC, ax->accel));
+	}
+	else{
+		a = 0;
+		dt = icbrt64(div64_u64(6000000000000000000ULL, ax->jerk)) * NSEC_PER_USEC;
+	}
+	for(i = 0; i < RAMP_MAX - 1 && v < v_max; i++){
+		ax->ramp[i] = min_t(u64, dt, U32_MAX);
+		a_prev = a;
+		if(ax->jerk){
+			/* start easing off when the velocity gained while
+			 * acceleration drops to zero would overshoot */
+			da = div_u64((u64)ax->jerk * dt, NSEC_PER_MSEC);
+			if(v + div64_u64(a * a, 2000ULL * ax->jerk) >= v_max)a = a > da ? a - da : 0;
+			else a = min(a + da, a_max);
+		}
+		v += div_u64((a_prev + a) / 2 * dt, NSEC_PER_SEC);
+		if(v == 0 || (ax->jerk && a == 0))break;
+		dt = div64_u64(1000ULL * NSEC_PER_SEC, v);
+	}
+	ax->ramp[i] = max(dt, cruise);
+	ax->ramp_len = i + 1;
+}
+
+/* position change of one step in direction dir at ustep microstepping,
+ * automatic segments count their steps in the finest mode */
+static int step_increment(int dir, unsigned int ustep)
+{
+	if(ustep == 0)ustep = A4988_USTEP_MAX;
+	return dir ? -(A4988_USTEP_MAX / ustep) : A4988_USTEP_MAX / ustep;
+}
+
+/* closed loop
+ * the encoder counts edges without direction, so the distance commanded
+ * since the baseline is compared with the distance the encoder saw */
+static void loss_baseline(struct a4988 *ax)
+{
+	ax->enc_base = ax->encoder_edges(ax->encoder);
+	ax->travel = 0;
+	ax->pos_base = atomic64_read(&ax->position);
+	ax->loss_error = 0;
+}
+
+/* encoder distance since the baseline in 1/A4988_USTEP_MAX steps */
+static s64 loss_enc_travel(struct a4988 *ax)
+{
+	s64 edges = ax->encoder_edges(ax->encoder) - ax->enc_base;
+	return edges < 0 ? -1 : (edges * ax->enc_scale) >> 16;
+}
+
+/* called after every step from the timer, returns 1 when the axis has
+ * to stop; loss_handle() takes it from there */
+static int loss_check(struct a4988 *ax)
+{
+	s64 enc;
+
+	ax->travel += abs(ax->step_inc);
+	enc = loss_enc_travel(ax);
+	/* the encoder was reset under us */
+	if(enc < 0){
+		loss_baseline(ax);
+		return 0;
+	}
+	ax->loss_error = min_t(s64, ax->travel - enc, INT_MAX);
+	if(ax->loss_error <= (int)ax->loss_tolerance)return 0;
+	ax->loss_count++;
+	ax->loss_last = ax->loss_error;
+	schedule_work(&ax->loss_work);
+	if(ax->loss_action == LOSS_REPORT){
+		loss_baseline(ax);
+		return 0;
+	}
+	/* busy stays set until loss_handle() has sorted the position out */
+	spin_lock(&ax->queue_lock);
+	ax->loss_target = ax->queued_position;
+	kfifo_reset(&ax->queue);
+	ax->loss_stopped = 1;
+	spin_unlock(&ax->queue_lock);
+	ax->steps = 0;
+	wake_up_interruptible(&ax->wait);
+	return 1;
+}
+
+/* makes seg the running segment, DIR and MS change while STEP is low;
+ * automatic segments start in the finest mode */
+static void load_segment(struct a4988 *ax, const struct step_segment *seg)
+{
+	ax->seg_auto = seg->ustep == 0;
+	ax->ustep = ax->seg_auto ? A4988_USTEP_MAX : seg->ustep;
+	pin_set(ax, DIR_PIN, seg->dir);
+	set_ustep_pins(ax, ax->ustep);
+	ax->dir = seg->dir;
+	ax->step_inc = step_increment(seg->dir, ax->ustep);
+	ax->step_unit = 1;
+	ax->steps = seg->steps;
+	ax->seg_interval = seg->interval;
+	ax->step_index = 0;
+	if(ax->encoder_edges)loss_baseline(ax);
+}
+
+/* picks the mode of the next step of an automatic segment from the ramp
+ * interval ahead, called after a falling edge so MS settles before STEP
+ * rises. A coarser mode is taken only where the translator sits on one of
+ * its steps and it does not overshoot the segment end, going finer is
+ * always aligned. Switching back down waits for 1/8 below the threshold. */
+static void auto_ustep(struct a4988 *ax)
+{
+	unsigned int i, k, unit;
+	u32 interval;
+
+	i = min(ax->step_index, ax->steps - 1);
+	if(i >= ax->ramp_len)i = ax->ramp_len - 1;
+	interval = ax->ramp[i];
+	for(k = 0; k < AUTO_MODES && ax->auto_interval[k] && interval <= ax->auto_interval[k]; k++);
+	unit = 1 << k;
+	if(unit < ax->step_unit){
+		k = ilog2(ax->step_unit) - 1;
+		if((u64)interval * 7 <= (u64)ax->auto_interval[k] * 8)unit = ax->step_unit;
+	}
+	while(unit > 1 && ((ax->phase & (unit - 1)) || ax->steps < unit))unit >>= 1;
+	if(unit == ax->step_unit)return;
+	ax->step_unit = unit;
+	ax->ustep = A4988_USTEP_MAX / unit;
+	ax->step_inc = step_increment(ax->dir, ax->ustep);
+	set_ustep_pins(ax, ax->ustep);
+}
+
+/* velocities to switching intervals, called with step_mutex held */
+static void auto_intervals(struct a4988 *ax)
+{
+	int k;
+	for(k = 0; k < AUTO_MODES; k++)
+		ax->auto_interval[k] = ax->auto_threshold[k] ? NSEC_PER_SEC / ax->auto_threshold[k] : 0;
+}
+
+/* loads the next queued segment, or marks the axis idle when there is
+ * none and returns 0; called from the timers */
+static int next_segment(struct a4988 *ax)
+{
+	struct step_segment seg;
+
+	spin_lock(&ax->queue_lock);
+	if(!kfifo_get(&ax->queue, &seg)){
+		ax->busy = 0;
+		spin_unlock(&ax->queue_lock);
+		wake_up_interruptible(&ax->wait);
+		schedule_work(&ax->busy_work);
+		return 0;
+	}
+	load_segment(ax, &seg);
+	spin_unlock(&ax->queue_lock);
+	wake_up_interruptible(&ax->wait);
+	return 1;
+}
+
+static void jitter_reset(struct jitter *j)
+{
+	unsigned long flags;
+	spin_lock_irqsave(&j->lock, flags);
+	memset(j->hist, 0, sizeof(j->hist));
+	j->count = 0;
+	j->sum = 0;
+	j->min = U32_MAX;
+	j->max = 0;
+	j->overruns = 0;
+	spin_unlock_irqrestore(&j->lock, flags);
+}
+
+static void jitter_init(struct jitter *j)
+{
+	spin_lock_init(&j->lock);
+	jitter_reset(j);
+}
+
+/* called first thing in the timer, the edge goes out right after */
+static void jitter_record(struct jitter *j, struct hrtimer *timer)
+{
+	s64 late = ktime_to_ns(ktime_sub(ktime_get(), hrtimer_get_expires(timer)));
+	u32 ns = late < 0 ? 0 : min_t(s64, late, U32_MAX);
+
+	spin_lock(&j->lock);
+	j->hist[min_t(u32, ns / JITTER_BUCKET_NS, JITTER_BUCKETS - 1)]++;
+	j->count++;
+	j->sum += ns;
+	if(ns < j->min)j->min = ns;
+	if(ns > j->max)j->max = ns;
+	spin_unlock(&j->lock);
+}
+
+/* hrtimer_forward_now() skipping periods means the next edge was due
+ * already, it goes out immediately and the interval is lost */
+static void jitter_forward(struct jitter *j, struct hrtimer *timer, u32 ns)
+{
+	if(hrtimer_forward_now(timer, ns_to_ktime(ns)) > 1){
+		spin_lock(&j->lock);
+		j->overruns++;
+		spin_unlock(&j->lock);
+	}
+}
+
+/* upper bound in ns of the bucket holding the permille-th edge */
+static u32 jitter_percentile(const struct jitter *j, u64 count, unsigned int permille)
+{
+	u64 sum = 0;
+	unsigned int i;
+	for(i = 0; i < JITTER_BUCKETS - 1; i++){
+		sum += j->hist[i];
+		if(sum * 1000 >= count * permille)break;
+	}
+	return i == JITTER_BUCKETS - 1 ? j->max : (i + 1) * JITTER_BUCKET_NS;
+}
+
+static int jitter_show(struct seq_file *m, void *v)
+{
+	struct jitter *j = m->private, snap;
+	unsigned long flags;
+	unsigned int i;
+
+	spin_lock_irqsave(&j->lock, flags);
+	snap = *j;
+	spin_unlock_irqrestore(&j->lock, flags);
+
+	seq_printf(m, "edges: %llu\noverruns: %u\n", (unsigned long long)snap.count, snap.overruns);
+	if(snap.count == 0)return 0;
+	seq_printf(m, "min: %u ns\nmax: %u ns\nmean: %llu ns\n", snap.min, snap.max,
+		(unsigned long long)div64_u64(snap.sum, snap.count));
+	seq_printf(m, "p50: %u ns\np90: %u ns\np99: %u ns\np99.9: %u ns\n",
+		jitter_percentile(&snap, snap.count, 500), jitter_percentile(&snap, snap.count, 900),
+		jitter_percentile(&snap, snap.count, 990), jitter_percentile(&snap, snap.count, 999));
+	seq_puts(m, "histogram (us: edges):\n");
+	for(i = 0; i < JITTER_BUCKETS; i++)
+		if(snap.hist[i])seq_printf(m, "%s%u: %u\n", i == JITTER_BUCKETS - 1 ? ">=" : "",
+			i * JITTER_BUCKET_NS / 1000, snap.hist[i]);
+	return 0;
+}
+
+static int jitter_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, jitter_show, inode->i_private);
+}
+
+/* any write clears the statistics */
+static ssize_t jitter_write(struct file *file, const char __user *buf, size_t lbuf, loff_t *ppos)
+{
+	struct seq_file *m = file->private_data;
+	jitter_reset(m->private);
+	return lbuf;
+}
+
+static const struct file_operations jitter_fops = {
+	.owner = THIS_MODULE,
+	.open = jitter_open,
+	.read = seq_read,
+	.write = jitter_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/* step generator
+ * the rising edge fetches the interval of the step, STEP stays high for
+ * half of it; steps at the end of a planned segment mirror the ramp.
+ * The next queued segment starts right after the last falling edge. */
+static enum hrtimer_restart step_timer_func(struct hrtimer *timer)
+{
+	struct a4988 *ax = container_of(timer, struct a4988, timer);
+	unsigned int i;
+	u32 interval;
+
+	jitter_record(&ax->jitter, timer);
+	ax->step_level = !ax->step_level;
+	pin_set(ax, STEP_PIN, ax->step_level);
+	if(ax->step_level){
+		if(ax->seg_interval)interval = ax->seg_interval;
+		else{
+			i = min(ax->step_index, ax->steps - 1);
+			if(i >= ax->ramp_len)i = ax->ramp_len - 1;
+			interval = ax->ramp[i] * ax->step_unit;
+		}
+		ax->step_low = interval - (interval >> 1);
+		ax->step_index += ax->step_unit;
+		jitter_forward(&ax->jitter, timer, interval >> 1);
+		return HRTIMER_RESTART;
+	}
+	atomic64_add(ax->step_inc, &ax->position);
+	ax->phase = (ax->phase + ax->step_inc) & (PHASE_CYCLE - 1);
+	if(ax->encoder_edges && loss_check(ax))return HRTIMER_NORESTART;
+	ax->steps -= ax->step_unit;
+	if(ax->steps == 0 && !next_segment(ax))return HRTIMER_NORESTART;
+	if(ax->seg_auto)auto_ustep(ax);
+	jitter_forward(&ax->jitter, timer, ax->step_low);
+	return HRTIMER_RESTART;
+}
+
+/* PRU backend
+ * cuts the running segment into ring entries: one per step on the
+ * ramps and one for the whole cruise part */
+static void next_chunk(struct a4988 *ax, u32 *count, u32 *interval)
+{
+	unsigned int i;
+
+	if(ax->seg_interval){
+		*count = ax->steps;
+		*interval = ax->seg_interval;
+	}
+	else{
+		i = min(ax->step_index, ax->steps - 1);
+		if(i >= ax->ramp_len - 1){
+			*count = ax->steps - (ax->ramp_len - 1);
+			*interval = ax->ramp[ax->ramp_len - 1];
+		}
+		else{
+			*count = 1;
+			*interval = ax->ramp[i];
+		}
+	}
+	ax->steps -= *count;
+	ax->step_index += *count;
+}
+
+static void pru_push(struct a4988 *ax, u32 count, u32 interval)
+{
+	void __iomem *entry = ax->pru_ram + PRU_RING_BASE + ax->pru_head * PRU_ENTRY_SIZE;
+	u32 high = (interval >> 1) / PRU_NS_PER_LOOP;
+	u32 low = (interval - (interval >> 1)) / PRU_NS_PER_LOOP;
+
+	writel(count, entry);
+	writel(high > PRU_HIGH_OVERHEAD ? high - PRU_HIGH_OVERHEAD : 1, entry + 4);
+	writel(low > PRU_LOW_OVERHEAD ? low - PRU_LOW_OVERHEAD : 1, entry + 8);
+	writel(ax->step_inc, entry + 12);
+	ax->pru_head = (ax->pru_head + 1) & (PRU_RING_LEN - 1);
+}
+
+/* takes the place of step_timer_func(), tops up the ring every
+ * PRU_REFILL_NS; a segment with another microstep mode waits for the
+ * ring to drain, the MS pins are not driven by the PRU */
+static enum hrtimer_restart pru_refill_func(struct hrtimer *timer)
+{
+	struct a4988 *ax = container_of(timer, struct a4988, timer);
+	struct step_segment seg;
+	u32 tail, count, interval, pos;
+
+	/* the PRU stores the position before moving the tail, so it
+	 * accounts for every entry up to tail */
+	tail = readl(ax->pru_ram + PRU_RING_TAIL);
+	pos = readl(ax->pru_ram + PRU_RING_POSITION);
+	atomic64_add((s32)(pos - ax->pru_position), &ax->position);
+	ax->phase = (ax->phase + pos - ax->pru_position) & (PHASE_CYCLE - 1);
+	ax->pru_position = pos;
+
+	while(((ax->pru_head + 1) & (PRU_RING_LEN - 1)) != tail){
+		if(ax->steps == 0){
+			spin_lock(&ax->queue_lock);
+			if(!kfifo_peek(&ax->queue, &seg) || (seg.ustep != ax->ustep && ax->pru_head != tail)){
+				spin_unlock(&ax->queue_lock);
+				break;
+			}
+			kfifo_skip(&ax->queue);
+			load_segment(ax, &seg);
+			spin_unlock(&ax->queue_lock);
+			wake_up_interruptible(&ax->wait);
+		}
+		next_chunk(ax, &count, &interval);
+		pru_push(ax, count, interval);
+	}
+	writel(ax->pru_head, ax->pru_ram + PRU_RING_HEAD);
+
+	if(ax->steps == 0 && ax->pru_head == tail){
+		spin_lock(&ax->queue_lock);
+		if(kfifo_is_empty(&ax->queue)){
+			ax->busy = 0;
+			spin_unlock(&ax->queue_lock);
+			wake_up_interruptible(&ax->wait);
+			schedule_work(&ax->busy_work);
+			return HRTIMER_NORESTART;
+		}
+		spin_unlock(&ax->queue_lock);
+	}
+	hrtimer_forward_now(timer, ns_to_ktime(PRU_REFILL_NS));
+	return HRTIMER_RESTART;
+}
+
+/* loads the firmware into the selected PRU with an empty ring */
+static int pru_start(struct a4988 *ax)
+{
+	const struct firmware *fw;
+	void __iomem *iram;
+	int err;
+
+	ax->pru_ram = ioremap(PRUSS_BASE + PRU_DRAM + ax->pru * PRU_DRAM_OFFSET, PRU_RAM_SIZE);
+	ax->pru_ctrl = ioremap(PRUSS_BASE + PRU_CTRL + ax->pru * PRU_CTRL_OFFSET, 4);
+	iram = ioremap(PRUSS_BASE + PRU_IRAM + ax->pru * PRU_IRAM_OFFSET, PRU_RAM_SIZE);
+	if(!ax->pru_ram || !ax->pru_ctrl || !iram){
+		printk(KERN_ERR "%s: Cannot map PRU%i memory\n", DRVNAME, ax->pru);
+		err = -ENOMEM;
+		goto err1;
+	}
+	err = request_firmware(&fw, PRU_FIRMWARE, ax->dev);
+	if(err){
+		printk(KERN_ERR "%s: Cannot load %s(%i)\n", DRVNAME, PRU_FIRMWARE, err);
+		goto err1;
+	}
+	if(fw->size > PRU_RAM_SIZE){
+		printk(KERN_ERR "%s: %s does not fit in PRU memory\n", DRVNAME, PRU_FIRMWARE);
+		err = -EINVAL;
+		goto err2;
+	}
+	writel(PRU_CTRL_RESET, ax->pru_ctrl);
+	memset_io(ax->pru_ram, 0, PRU_RING_BASE);
+	ax->pru_head = 0;
+	ax->pru_position = 0;
+	memcpy_toio(iram, fw->data, fw->size);
+	writel(PRU_CTRL_ENABLE, ax->pru_ctrl);
+	release_firmware(fw);
+	iounmap(iram);
+	return 0;
+
+	err2:
+	release_firmware(fw);
+	err1:
+	if(iram)iounmap(iram);
+	if(ax->pru_ctrl)iounmap(ax->pru_ctrl);
+	if(ax->pru_ram)iounmap(ax->pru_ram);
+	return err;
+}
+
+static void pru_stop(struct a4988 *ax)
+{
+	writel(PRU_CTRL_DISABLE, ax->pru_ctrl);
+	iounmap(ax->pru_ctrl);
+	iounmap(ax->pru_ram);
+}
+
+/* PWM backend
+ * a thread walks the queue with next_chunk() like the PRU refill does,
+ * since pwm_config() may sleep. The PWM keeps running between chunks and
+ * segments going the same way, so a cruise costs one interrupt per step
+ * and one wakeup. Pulses out while the thread wakes up count into the
+ * next chunk; before a stop the interrupt itself ends the output at the
+ * last pulse, pwm_disable() would come a wakeup too late. */
+static irqreturn_t pwm_edge_irq(int irq, void *dev_id)
+{
+	struct a4988 *ax = dev_id;
+	u32 edges;
+	atomic64_add(ax->step_inc, &ax->position);
+	edges = atomic_inc_return(&ax->pwm_edges);
+	if((s32)(edges - ACCESS_ONCE(ax->pwm_target)) >= 0){
+		if(ACCESS_ONCE(ax->pwm_stopping))
+			am335x_ehrpwm_force_low(ax->pwm_regs, AM335X_EHRPWM_CHANNEL(ax->pwm_id));
+		wake_up(&ax->pwm_wait);
+	}
+	return IRQ_HANDLED;
+}
+
+static void pwm_halt(struct a4988 *ax)
+{
+	ax->pwm_stopping = 0;
+	if(!ax->pwm_on)return;
+	pwm_disable(ax->pwm);
+	ax->pwm_on = 0;
+}
+
+/* whether the PWM may keep running into the next queued segment */
+static int pwm_continues(struct a4988 *ax)
+{
+	struct step_segment seg;
+	unsigned long flags;
+	int ok;
+
+	spin_lock_irqsave(&ax->queue_lock, flags);
+	ok = kfifo_peek(&ax->queue, &seg);
+	spin_unlock_irqrestore(&ax->queue_lock, flags);
+	return ok && seg.dir == ax->dir && seg.ustep == ax->ustep;
+}
+
+/* count pulses at interval, returns once they are out; with last the
+ * output stops right after them */
+static void pwm_chunk(struct a4988 *ax, u32 count, u32 interval, int last)
+{
+	ACCESS_ONCE(ax->pwm_target) = ax->pwm_target + count;
+	smp_wmb();
+	ACCESS_ONCE(ax->pwm_stopping) = last;
+	if(interval != ax->pwm_period){
+		pwm_config(ax->pwm, interval >> 1, interval);
+		ax->pwm_period = interval;
+	}
+	if(!ax->pwm_on){
+		pwm_enable(ax->pwm);
+		ax->pwm_on = 1;
+	}
+	wait_event_interruptible(ax->pwm_wait,
+		(s32)(atomic_read(&ax->pwm_edges) - ax->pwm_target) >= 0 || kthread_should_stop());
+}
+
+/* loads the next segment, stopping the PWM first when DIR or MS change
+ * or nothing is queued, or the interrupt already stopped the output;
+ * returns 0 when the axis went idle */
+static int pwm_next(struct a4988 *ax)
+{
+	struct step_segment seg;
+	unsigned long flags;
+
+	if(ax->pwm_stopping || !pwm_continues(ax))pwm_halt(ax);
+
+	spin_lock_irqsave(&ax->queue_lock, flags);
+	if(!kfifo_get(&ax->queue, &seg)){
+		ax->busy = 0;
+		spin_unlock_irqrestore(&ax->queue_lock, flags);
+		wake_up_interruptible(&ax->wait);
+		schedule_work(&ax->busy_work);
+		return 0;
+	}
+	load_segment(ax, &seg);
+	spin_unlock_irqrestore(&ax->queue_lock, flags);
+	wake_up_interruptible(&ax->wait);
+	return 1;
+}
+
+static int pwm_thread(void *data)
+{
+	struct a4988 *ax = data;
+	u32 count, interval;
+
+	for(;;){
+		set_current_state(TASK_INTERRUPTIBLE);
+		if(kthread_should_stop())break;
+		if(!ax->busy){
+			schedule();
+			continue;
+		}
+		__set_current_state(TASK_RUNNING);
+		do{
+			while(ax->steps && !kthread_should_stop()){
+				next_chunk(ax, &count, &interval);
+				pwm_chunk(ax, count, interval, ax->steps == 0 && !pwm_continues(ax));
+			}
+		}while(!kthread_should_stop() && pwm_next(ax));
+	}
+	__set_current_state(TASK_RUNNING);
+	pwm_halt(ax);
+	return 0;
+}
+
+static int pwm_start(struct a4988 *ax)
+{
+	int err;
+
+	init_waitqueue_head(&ax->pwm_wait);
+	atomic_set(&ax->pwm_edges, 0);
+	ax->pwm_regs = am335x_ehrpwm_map(ax->pwm_id);
+	if(!ax->pwm_regs){
+		printk(KERN_ERR "%s: Cannot map PWM%i registers\n", DRVNAME, ax->pwm_id);
+		return -ENOMEM;
+	}
+	ax->pwm = pwm_request(ax->pwm_id, "a4988_step");
+	if(IS_ERR_OR_NULL(ax->pwm)){
+		printk(KERN_ERR "%s: Cannot use PWM%i\n", DRVNAME, ax->pwm_id);
+		iounmap(ax->pwm_regs);
+		return -ENODEV;
+	}
+	pwm_set_polarity(ax->pwm, PWM_POLARITY_NORMAL);
+	err = request_irq(gpio_to_irq(ax->pins[STEP_PIN]), pwm_edge_irq, IRQF_TRIGGER_RISING, "a4988_step", ax);
+	if(err){
+		printk(KERN_ERR "%s: Cannot request interrupt(%i)\n", DRVNAME, err);
+		goto err1;
+	}
+	ax->pwm_task = kthread_run(pwm_thread, ax, "a4988_%i", ax->id);
+	if(IS_ERR(ax->pwm_task)){
+		err = PTR_ERR(ax->pwm_task);
+		goto err2;
+	}
+	return 0;
+
+	err2:
+	free_irq(gpio_to_irq(ax->pins[STEP_PIN]), ax);
+	err1:
+	pwm_free(ax->pwm);
+	iounmap(ax->pwm_regs);
+	return err;
+}
+
+static void pwm_stop(struct a4988 *ax)
+{
+	kthread_stop(ax->pwm_task);
+	free_irq(gpio_to_irq(ax->pins[STEP_PIN]), ax);
+	pwm_free(ax->pwm);
+	iounmap(ax->pwm_regs);
+}
+
+/* axes stepped by the hrtimer; only they take part in lines, automatic
+ * microstepping and the closed loop */
+static int soft_steps(struct a4988 *ax)
+{
+	return ax->pru < 0 && ax->pwm_id < 0;
+}
+
+static unsigned int speed_limit(struct a4988 *ax)
+{
+	if(ax->pru >= 0)return PRU_SPEED_MAX;
+	if(ax->pwm_id >= 0)return PWM_SPEED_MAX;
+	return SPEED_MAX;
+}
+
+/* sysfs_notify() may sleep, so it cannot be called from the timer */
+static void busy_notify(struct work_struct *work)
+{
+	struct a4988 *ax = container_of(work, struct a4988, busy_work);
+	sysfs_notify(&ax->dev->kobj, NULL, "busy");
+}
+
+/* appends seg to the queue and starts the generator if it is idle,
+ * returns 0 when the queue is full; called with step_mutex held.
+ * While the coordinator holds the axis it only queues. */
+static int queue_segment(struct a4988 *ax, const struct step_segment *seg)
+{
+	struct step_segment first;
+	unsigned long flags;
+	int ret;
+
+	spin_lock_irqsave(&ax->queue_lock, flags);
+	ret = kfifo_put(&ax->queue, seg);
+	if(ret){
+		if(!ax->busy)ax->queued_position = atomic64_read(&ax->position);
+		ax->queued_position += (s64)seg->steps * step_increment(seg->dir, seg->ustep);
+	}
+	if(ret && !ax->busy && kfifo_get(&ax->queue, &first)){
+		load_segment(ax, &first);
+		ax->step_level = 0;
+		ax->busy = 1;
+		ax->retries = 0;
+		if(ax->pwm_id >= 0)wake_up_process(ax->pwm_task);
+		else hrtimer_start(&ax->timer, ktime_set(0, 0), HRTIMER_MODE_REL);
+		schedule_work(&ax->busy_work);
+	}
+	spin_unlock_irqrestore(&ax->queue_lock, flags);
+	return ret;
+}
+
+/* builds a planned move from the end of the queue to target in the
+ * current microstep mode, target must lie on a step of that mode;
+ * in automatic mode any target works */
+static int plan_move_to(struct a4988 *ax, s64 target, struct step_segment *seg)
+{
+	s64 delta;
+	u64 steps;
+	u32 rem;
+	unsigned int unit = ax->ustep_auto ? 1 : A4988_USTEP_MAX / ax->ustep;
+
+	delta = target - (ax->busy ? ax->queued_position : atomic64_read(&ax->position));
+	seg->dir = delta < 0;
+	if(delta < 0)delta = -delta;
+	/* 64-bit division has to go through the math64 helpers on ARM */
+	steps = div_u64_rem(delta, unit, &rem);
+	if(rem)return -EINVAL;
+	if(steps > U32_MAX)return -ERANGE;
+	seg->steps = steps;
+	seg->interval = 0;
+	seg->ustep = ax->ustep_auto ? 0 : ax->ustep;
+	return 0;
+}
+
+/* reports a step loss; when the timer stopped the axis, the position is
+ * taken from the encoder, accel (or speed without ramps) drops by a
+ * quarter and with LOSS_RETRY the axis heads for the old queue end again.
+ * Moves queued after the loss are dropped. */
+static void loss_handle(struct work_struct *work)
+{
+	struct a4988 *ax = container_of(work, struct a4988, loss_work);
+	struct step_segment seg;
+	unsigned long flags;
+	unsigned int unit, retries;
+	s64 enc, pos;
+	int err;
+
+	printk(KERN_WARNING "%s: axis %i lost steps, encoder %i/%i steps behind\n", DRVNAME,
+		ax->id, ax->loss_last, A4988_USTEP_MAX);
+	sysfs_notify(&ax->dev->kobj, NULL, "step_loss");
+
+	mutex_lock(&ax->step_mutex);
+	if(!ax->loss_stopped){
+		mutex_unlock(&ax->step_mutex);
+		return;
+	}
+	enc = loss_enc_travel(ax);
+	if(enc >= 0){
+		unit = ax->ustep_auto ? 1 : A4988_USTEP_MAX / ax->ustep;
+		pos = ax->pos_base + (ax->dir ? -enc : enc);
+		pos = div_s64(pos + (pos < 0 ? -(s64)unit / 2 : unit / 2), unit) * unit;
+		atomic64_set(&ax->position, pos);
+	}
+	if(ax->accel > 1)ax->accel -= ax->accel / 4;
+	else if(ax->speed > 1)ax->speed -= ax->speed / 4;
+	build_ramp(ax);
+
+	spin_lock_irqsave(&ax->queue_lock, flags);
+	kfifo_reset(&ax->queue);
+	ax->loss_stopped = 0;
+	ax->busy = 0;
+	spin_unlock_irqrestore(&ax->queue_lock, flags);
+
+	retries = ax->retries;
+	err = 0;
+	if(ax->loss_action == LOSS_RETRY && retries < LOSS_RETRIES){
+		err = plan_move_to(ax, ax->loss_target, &seg);
+		if(!err && seg.steps){
+			queue_segment(ax, &seg);
+			ax->retries = retries + 1;
+		}
+	}
+	else if(ax->loss_action == LOSS_RETRY)err = -EIO;
+	if(err)printk(KERN_ERR "%s: axis %i cannot retry the move(%i)\n", DRVNAME, ax->id, err);
+	wake_up_interruptible(&ax->wait);
+	schedule_work(&ax->busy_work);
+	mutex_unlock(&ax->step_mutex);
+}
+
+/* only while idle, queued moves would end up somewhere else */
+static int set_position(struct a4988 *ax, s64 pos)
+{
+	if(!mutex_trylock(&ax->step_mutex))return -EBUSY;
+	if(ax->busy){
+		mutex_unlock(&ax->step_mutex);
+		return -EBUSY;
+	}
+	atomic64_set(&ax->position, pos);
+	ax->queued_position = pos;
+	mutex_unlock(&ax->step_mutex);
+	return 0;
+}
+
+/* takes step_mutex following the policy, shared by steps and
+ * target_position: queue waits for it, the others refuse a busy axis */
+static int policy_lock(struct a4988 *ax)
+{
+	if(ax->policy == POLICY_QUEUE){
+		if(mutex_lock_interruptible(&ax->step_mutex))return -ERESTARTSYS;
+		return 0;
+	}
+	if(!mutex_trylock(&ax->step_mutex))return -EBUSY;
+	if(ax->busy){
+		mutex_unlock(&ax->step_mutex);
+		return -EBUSY;
+	}
+	return 0;
+}
+
+/* queues seg after policy_lock(), waiting for room with queue; the
+ * caller unlocks step_mutex */
+static int policy_queue(struct a4988 *ax, struct step_segment *seg)
+{
+	while(!queue_segment(ax, seg))
+		if(wait_event_interruptible(ax->wait, !kfifo_is_full(&ax->queue)))return -ERESTARTSYS;
+	return 0;
+}
+
+/* show and store functions declarations */
+static ssize_t enable_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct a4988 *ax = dev_get_drvdata(dev);
+	return sprintf(buf, "%u", ax->enable);
+}
+static ssize_t enable_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct a4988 *ax = dev_get_drvdata(dev);
+	unsigned int tmp;
+	sscanf(buf, "%u", &tmp);
+	if(tmp > 1)tmp = 1;
+	ax->enable = tmp;
+	gpio_set_value(ax->pins[ENABLE_PIN], !ax->enable);
+	return count;
+}
+
+static ssize_t sleep_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct a4988 *ax = dev_get_drvdata(dev);
+	return sprintf(buf, "%u", ax->sleep);
+}
+static ssize_t sleep_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct a4988 *ax = dev_get_drvdata(dev);
+	unsigned int tmp;
+	sscanf(buf, "%u", &tmp);
+	if(tmp > 1)tmp = 1;
+	ax->sleep = tmp;
+	gpio_set_value(ax->pins[SLEEP_PIN], !ax->sleep);
+	return count;
+}
+
+static ssize_t reset_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct a4988 *ax = dev_get_drvdata(dev);
+	return sprintf(buf, "%u", ax->reset);
+}
+static ssize_t reset_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct a4988 *ax = dev_get_drvdata(dev);
+	unsigned int tmp;
+	sscanf(buf, "%u", &tmp);
+	if(tmp > 1)tmp = 1;
+	ax->reset = tmp;
+	gpio_set_value(ax->pins[RESET_PIN], !ax->reset);
+	/* the translator goes back to its home state */
+	if(ax->reset)ax->phase = 0;
+	return count;
+}
+
+static ssize_t ustep_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct a4988 *ax = dev_get_drvdata(dev);
+	return sprintf(buf, "%u", ax->ustep);
+}
+static ssize_t ustep_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct a4988 *ax = dev_get_drvdata(dev);
+	unsigned int tmp;
+	sscanf(buf, "%u", &tmp);
+	if(!mutex_trylock(&ax->step_mutex))return -EBUSY;
+	if(ax->busy){
+		mutex_unlock(&ax->step_mutex);
+		return -EBUSY;
+	}
+	if(set_ustep_pins(ax, tmp) != 0){
+		mutex_unlock(&ax->step_mutex);
+		return -EINVAL;
+	}
+	ax->ustep = tmp;
+	mutex_unlock(&ax->step_mutex);
+	return count;
+}
+
+static ssize_t steps_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct a4988 *ax = dev_get_drvdata(dev);
+	return sprintf(buf, "%u", ax->steps);
+}
+static ssize_t steps_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct a4988 *ax = dev_get_drvdata(dev);
+	struct step_segment seg;
+	unsigned int tmp;
+	int err;
+	if(sscanf(buf, "%u", &tmp) != 1)return -EINVAL;
+	if(tmp == 0)return count;
+	seg.steps = tmp;
+	seg.interval = 0;
+	seg.dir = ax->dir;
+	seg.ustep = ax->ustep_auto ? 0 : ax->ustep;
+	err = policy_lock(ax);
+	if(err)return err;
+	err = policy_queue(ax, &seg);
+	mutex_unlock(&ax->step_mutex);
+	return err ? err : count;
+}
+
+static ssize_t position_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct a4988 *ax = dev_get_drvdata(dev);
+	return sprintf(buf, "%lld", (long long)atomic64_read(&ax->position));
+}
+static ssize_t position_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct a4988 *ax = dev_get_drvdata(dev);
+	long long tmp;
+	int err;
+	if(sscanf(buf, "%lld", &tmp) != 1)return -EINVAL;
+	err = set_position(ax, tmp);
+	return err ? err : count;
+}
+
+/* reads back where the queued moves end */
+static ssize_t target_position_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct a4988 *ax = dev_get_drvdata(dev);
+	unsigned long flags;
+	s64 pos;
+	spin_lock_irqsave(&ax->queue_lock, flags);
+	pos = ax->busy ? ax->queued_position : atomic64_read(&ax->position);
+	spin_unlock_irqrestore(&ax->queue_lock, flags);
+	return sprintf(buf, "%lld", (long long)pos);
+}
+static ssize_t target_position_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct a4988 *ax = dev_get_drvdata(dev);
+	struct step_segment seg;
+	long long tmp;
+	int err;
+	if(sscanf(buf, "%lld", &tmp) != 1)return -EINVAL;
+	/* planned against the queue end, so queued in the same hold */
+	err = policy_lock(ax);
+	if(err)return err;
+	err = plan_move_to(ax, tmp, &seg);
+	if(!err && seg.steps)err = policy_queue(ax, &seg);
+	mutex_unlock(&ax->step_mutex);
+	return err ? err : count;
+}
+
+static ssize_t speed_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct a4988 *ax = dev_get_drvdata(dev);
+	return sprintf(buf, "%u", ax->speed);
+}
+/* the ramp parameters cannot change under a running move */
+static ssize_t set_ramp_param(struct a4988 *ax, unsigned int *param, const char *buf, size_t count, unsigned int lo, unsigned int hi)
+{
+	unsigned int tmp;
+	if(sscanf(buf, "%u", &tmp) != 1)return -EINVAL;
+	if(tmp < lo || tmp > hi)return -EINVAL;
+	if(!mutex_trylock(&ax->step_mutex))return -EBUSY;
+	if(ax->busy){
+		mutex_unlock(&ax->step_mutex);
+		return -EBUSY;
+	}
+	*param = tmp;
+	build_ramp(ax);
+	mutex_unlock(&ax->step_mutex);
+	return count;
+}
+
+static ssize_t speed_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct a4988 *ax = dev_get_drvdata(dev);
+	unsigned int limit = speed_limit(ax) * (ax->ustep_auto ? A4988_USTEP_MAX : 1);
+	return set_ramp_param(ax, &ax->speed, buf, count, 1, limit);
+}
+
+static ssize_t accel_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct a4988 *ax = dev_get_drvdata(dev);
+	return sprintf(buf, "%u", ax->accel);
+}
+static ssize_t accel_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct a4988 *ax = dev_get_drvdata(dev);
+	return set_ramp_param(ax, &ax->accel, buf, count, 0, ACCEL_MAX);
+}
+
+static ssize_t jerk_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct a4988 *ax = dev_get_drvdata(dev);
+	return sprintf(buf, "%u", ax->jerk);
+}
+static ssize_t jerk_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct a4988 *ax = dev_get_drvdata(dev);
+	return set_ramp_param(ax, &ax->jerk, buf, count, 0, JERK_MAX);
+}
+
+/* planned moves switch between microstep modes by themselves, speed,
+ * accel, jerk and steps are then in 1/A4988_USTEP_MAX steps */
+static ssize_t ustep_auto_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct a4988 *ax = dev_get_drvdata(dev);
+	return sprintf(buf, "%i", ax->ustep_auto);
+}
+static ssize_t ustep_auto_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct a4988 *ax = dev_get_drvdata(dev);
+	unsigned int tmp;
+	if(sscanf(buf, "%u", &tmp) != 1)return -EINVAL;
+	if(tmp > 1)tmp = 1;
+	/* the PRU and PWM cannot change the MS pins inside a segment */
+	if(tmp && !soft_steps(ax))return -EINVAL;
+	if(!mutex_trylock(&ax->step_mutex))return -EBUSY;
+	if(ax->busy){
+		mutex_unlock(&ax->step_mutex);
+		return -EBUSY;
+	}
+	ax->ustep_auto = tmp;
+	ax->speed = min(ax->speed, speed_limit(ax) * (ax->ustep_auto ? A4988_USTEP_MAX : 1));
+	build_ramp(ax);
+	mutex_unlock(&ax->step_mutex);
+	return count;
+}
+
+/* velocities in 1/A4988_USTEP_MAX steps/s above which automatic mode
+ * goes to 8, 4, 2 and 1 microsteps, increasing; 0 stops at that mode */
+static ssize_t ustep_thresholds_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct a4988 *ax = dev_get_drvdata(dev);
+	return sprintf(buf, "%u %u %u %u", ax->auto_threshold[0], ax->auto_threshold[1],
+		ax->auto_threshold[2], ax->auto_threshold[3]);
+}
+static ssize_t ustep_thresholds_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct a4988 *ax = dev_get_drvdata(dev);
+	unsigned int tmp[AUTO_MODES];
+	int k, n;
+	n = sscanf(buf, "%u %u %u %u", &tmp[0], &tmp[1], &tmp[2], &tmp[3]);
+	if(n < 1)return -EINVAL;
+	for(k = n; k < AUTO_MODES; k++)tmp[k] = 0;
+	for(k = 1; k < AUTO_MODES; k++){
+		if(tmp[k] && (tmp[k - 1] == 0 || tmp[k] <= tmp[k - 1]))return -EINVAL;
+	}
+	if(!mutex_trylock(&ax->step_mutex))return -EBUSY;
+	if(ax->busy){
+		mutex_unlock(&ax->step_mutex);
+		return -EBUSY;
+	}
+	memcpy(ax->auto_threshold, tmp, sizeof(tmp));
+	auto_intervals(ax);
+	mutex_unlock(&ax->step_mutex);
+	return count;
+}
 
-static unsigned int enable = 1, sleep = 0, reset = 0, ustep = 1, steps = 0;
-static char direction[DIR_SIZE];
-static struct class *a4988_class;
-int pins[] = {ENABLE_PIN, MS1_PIN, MS2_PIN, MS3_PIN, RESET_PIN, SLEEP_PIN, STEP_PIN, DIR_PIN};
-int pins_init_val[] = {0, 0, 0, 0, 1, 1, 0, 0};
-char *pins_names[] = {"enable", "ms1", "ms2", "ms3", "reset", "sleep", "step", "dir"};
+static ssize_t policy_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct a4988 *ax = dev_get_drvdata(dev);
+	return sprintf(buf, "%s", ax->policy == POLICY_QUEUE ? "queue" : "reject");
+}
+static ssize_t policy_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct a4988 *ax = dev_get_drvdata(dev);
+	size_t len;
+	len = strlen(buf);
+	if(buf[len - 1] == '\n')len--;
+	if(len == 5 && strncmp(buf, "queue", len) == 0)ax->policy = POLICY_QUEUE;
+	else if(len == 6 && strncmp(buf, "reject", len) == 0)ax->policy = POLICY_REJECT;
+	else return -EINVAL;
+	return count;
+}
 
-/* show and store functions declarations */
-static ssize_t enable_show(struct class *cls, struct class_attribute *attr, char *buf)
+/* dagu encoder channel closing the loop, 0 - A, 1 - B, -1 - none */
+static ssize_t encoder_show(struct device *dev, struct device_attribute *attr, char *buf)
 {
-	return sprintf(buf, "%u", enable);
+	struct a4988 *ax = dev_get_drvdata(dev);
+	return sprintf(buf, "%i", ax->encoder);
 }
-static ssize_t enable_store(struct class *cls, struct class_attribute *attr, const char *buf, size_t count)
+static ssize_t encoder_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
 {
-	unsigned int tmp;
-	sscanf(buf, "%u", &tmp);
-	if(tmp > 1)tmp = 1;
-	enable = tmp;
-	gpio_set_value(ENABLE_PIN, !enable);
+	struct a4988 *ax = dev_get_drvdata(dev);
+	int tmp;
+	if(sscanf(buf, "%i", &tmp) != 1 || tmp < -1 || tmp > 1)return -EINVAL;
+	if(tmp >= 0 && !soft_steps(ax))return -EINVAL;
+	if(!mutex_trylock(&ax->step_mutex))return -EBUSY;
+	if(ax->busy){
+		mutex_unlock(&ax->step_mutex);
+		return -EBUSY;
+	}
+	if(tmp >= 0 && !ax->encoder_edges){
+		ax->encoder_edges = symbol_get(dagu_encoder_edges);
+		if(!ax->encoder_edges){
+			mutex_unlock(&ax->step_mutex);
+			return -ENODEV;
+		}
+	}
+	else if(tmp < 0 && ax->encoder_edges){
+		symbol_put(dagu_encoder_edges);
+		ax->encoder_edges = NULL;
+	}
+	ax->encoder = tmp;
+	mutex_unlock(&ax->step_mutex);
 	return count;
 }
 
-static ssize_t sleep_show(struct class *cls, struct class_attribute *attr, char *buf)
+/* encoder edges per that many full steps, "192 200" for the dagu wheel
+ * encoder on a 200 step motor */
+static ssize_t encoder_ratio_show(struct device *dev, struct device_attribute *attr, char *buf)
 {
-	return sprintf(buf, "%u", sleep);
+	struct a4988 *ax = dev_get_drvdata(dev);
+	return sprintf(buf, "%u %u", ax->enc_counts, ax->enc_steps);
 }
-static ssize_t sleep_store(struct class *cls, struct class_attribute *attr, const char *buf, size_t count)
+static ssize_t encoder_ratio_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
 {
-	unsigned int tmp;
-	sscanf(buf, "%u", &tmp);
-	if(tmp > 1)tmp = 1;
-	sleep = tmp;
-	gpio_set_value(SLEEP_PIN, !sleep);
+	struct a4988 *ax = dev_get_drvdata(dev);
+	unsigned int counts, steps;
+	if(sscanf(buf, "%u %u", &counts, &steps) != 2)return -EINVAL;
+	if(counts == 0 || steps == 0 || steps > 65536)return -EINVAL;
+	if(!mutex_trylock(&ax->step_mutex))return -EBUSY;
+	if(ax->busy){
+		mutex_unlock(&ax->step_mutex);
+		return -EBUSY;
+	}
+	ax->enc_counts = counts;
+	ax->enc_steps = steps;
+	ax->enc_scale = div_u64(((u64)steps * A4988_USTEP_MAX) << 16, counts);
+	mutex_unlock(&ax->step_mutex);
 	return count;
 }
 
-static ssize_t reset_show(struct class *cls, struct class_attribute *attr, char *buf)
+/* how far, in 1/A4988_USTEP_MAX steps, the encoder may lag */
+static ssize_t loss_tolerance_show(struct device *dev, struct device_attribute *attr, char *buf)
 {
-	return sprintf(buf, "%u", reset);
+	struct a4988 *ax = dev_get_drvdata(dev);
+	return sprintf(buf, "%u", ax->loss_tolerance);
 }
-static ssize_t reset_store(struct class *cls, struct class_attribute *attr, const char *buf, size_t count)
+static ssize_t loss_tolerance_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
 {
+	struct a4988 *ax = dev_get_drvdata(dev);
 	unsigned int tmp;
-	sscanf(buf, "%u", &tmp);
-	if(tmp > 1)tmp = 1;
-	reset = tmp;
-	gpio_set_value(RESET_PIN, !reset);
+	if(sscanf(buf, "%u", &tmp) != 1 || tmp > INT_MAX)return -EINVAL;
+	ax->loss_tolerance = tmp;
 	return count;
 }
 
-static ssize_t ustep_show(struct class *cls, struct class_attribute *attr, char *buf)
+static ssize_t loss_action_show(struct device *dev, struct device_attribute *attr, char *buf)
 {
-	return sprintf(buf, "%u", ustep);
+	struct a4988 *ax = dev_get_drvdata(dev);
+	static const char *names[] = {"report", "stop", "retry"};
+	return sprintf(buf, "%s", names[ax->loss_action]);
 }
-static ssize_t ustep_store(struct class *cls, struct class_attribute *attr, const char *buf, size_t count)
+static ssize_t loss_action_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
 {
-	unsigned int tmp;
-	sscanf(buf, "%u", &tmp);
-	switch(tmp)
-	{
-		case 1:
-			gpio_set_value(MS1_PIN, 0);
-			gpio_set_value(MS2_PIN, 0);
-			gpio_set_value(MS3_PIN, 0);
-			break;
-		case 2:
-			gpio_set_value(MS1_PIN, 1);
-			gpio_set_value(MS2_PIN, 0);
-			gpio_set_value(MS3_PIN, 0);
-			break;
-		case 4:
-			gpio_set_value(MS1_PIN, 0);
-			gpio_set_value(MS2_PIN, 1);
-			gpio_set_value(MS3_PIN, 0);
-			break;
-		case 8:
-			gpio_set_value(MS1_PIN, 1);
-			gpio_set_value(MS2_PIN, 1);
-			gpio_set_value(MS3_PIN, 0);
-			break;
-		case 16:
-			gpio_set_value(MS1_PIN, 1);
-			gpio_set_value(MS2_PIN, 1);
-			gpio_set_value(MS3_PIN, 1);
-			break;
-		default:
-			return -EINVAL;
-	}
-	ustep = tmp;
+	struct a4988 *ax = dev_get_drvdata(dev);
+	size_t len;
+	len = strlen(buf);
+	if(buf[len - 1] == '\n')len--;
+	if(len == 6 && strncmp(buf, "report", len) == 0)ax->loss_action = LOSS_REPORT;
+	else if(len == 4 && strncmp(buf, "stop", len) == 0)ax->loss_action = LOSS_STOP;
+	else if(len == 5 && strncmp(buf, "retry", len) == 0)ax->loss_action = LOSS_RETRY;
+	else return -EINVAL;
 	return count;
 }
 
-static ssize_t steps_show(struct class *cls, struct class_attribute *attr, char *buf)
+/* losses detected so far, pollable */
+static ssize_t step_loss_show(struct device *dev, struct device_attribute *attr, char *buf)
 {
-	return sprintf(buf, "%u", steps);
+	struct a4988 *ax = dev_get_drvdata(dev);
+	return sprintf(buf, "%u", ax->loss_count);
 }
-static ssize_t steps_store(struct class *cls, struct class_attribute *attr, const char *buf, size_t count)
+
+static ssize_t following_error_show(struct device *dev, struct device_attribute *attr, char *buf)
 {
-	unsigned int tmp, i;
-	if(mutex_trylock(&step_mutex))
-	{
-		sscanf(buf, "%u", &tmp);
-		steps = tmp;
-		/*wykonanie odpowiedniej ilości kroków*/
-		for(i = 0; i < tmp; i++)
-		{
-			gpio_set_value(STEP_PIN, 1);
-			mdelay(1);
-			gpio_set_value(STEP_PIN, 0);
-			mdelay(1);
-			gpio_set_value(STEP_PIN, 1);
-			mdelay(1);
-			gpio_set_value(STEP_PIN, 0);
-			msleep(1);
-			if(i % 512 == 0)msleep(10);
-			steps--;
-		}
-		mutex_unlock(&step_mutex);
-		return count;
-	}
-	return -EBUSY;
+	struct a4988 *ax = dev_get_drvdata(dev);
+	return sprintf(buf, "%i", ax->loss_error);
+}
+
+static ssize_t busy_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct a4988 *ax = dev_get_drvdata(dev);
+	return sprintf(buf, "%i", ax->busy);
 }
 
-static ssize_t direction_show(struct class *cls, struct class_attribute *attr, char *buf)
+static ssize_t direction_show(struct device *dev, struct device_attribute *attr, char *buf)
 {
-	return sprintf(buf, "%s", direction);
+	struct a4988 *ax = dev_get_drvdata(dev);
+	return sprintf(buf, "%s", ax->dir ? "ccw" : "cw");
 }
-static ssize_t direction_store(struct class *cls, struct class_attribute *attr, const char *buf, size_t count)
+static ssize_t direction_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
 {
+	struct a4988 *ax = dev_get_drvdata(dev);
 	size_t len;
+	int dir;
 	len = strlen(buf);
 	if(buf[len - 1] == '\n')len--;
-	if(len > DIR_SIZE)return -EINVAL;
-	if(strncmp(buf, "cw", len) != 0 && strncmp(buf, "ccw", len) != 0)return -EINVAL;
-	memset(direction, '\0', DIR_SIZE);
-	strncpy(direction, buf, len);
-	/*ustawienie wyjść*/
-	if(strcmp(direction, "cw") == 0)gpio_set_value(DIR_PIN, 0);
-	else if(strcmp(direction, "ccw") == 0)gpio_set_value(DIR_PIN, 1);
+	if(len == 2 && strncmp(buf, "cw", len) == 0)dir = 0;
+	else if(len == 3 && strncmp(buf, "ccw", len) == 0)dir = 1;
 	else return -EINVAL;
+	/*kierunek nie może się zmienić w trakcie ruchu*/
+	if(!mutex_trylock(&ax->step_mutex))return -EBUSY;
+	if(ax->busy){
+		mutex_unlock(&ax->step_mutex);
+		return -EBUSY;
+	}
+	ax->dir = dir;
+	/*ustawienie wyjść*/
+	pin_set(ax, DIR_PIN, ax->dir);
+	mutex_unlock(&ax->step_mutex);
 	return count;
 }
 
 /* attributes */
-static struct class_attribute enable_attr = __ATTR(enable, 0660, enable_show, enable_store);
-static struct class_attribute sleep_attr = __ATTR(sleep, 0660, sleep_show, sleep_store);
-static struct class_attribute reset_attr = __ATTR(reset, 0660, reset_show, reset_store);
-static struct class_attribute ustep_attr = __ATTR(ustep, 0660, ustep_show, ustep_store);
-static struct class_attribute steps_attr = __ATTR(steps, 0660, steps_show, steps_store);
-static struct class_attribute direction_attr = __ATTR(direction, 0660, direction_show, direction_store);
+static DEVICE_ATTR(enable, 0660, enable_show, enable_store);
+static DEVICE_ATTR(sleep, 0660, sleep_show, sleep_store);
+static DEVICE_ATTR(reset, 0660, reset_show, reset_store);
+static DEVICE_ATTR(ustep, 0660, ustep_show, ustep_store);
+static DEVICE_ATTR(steps, 0660, steps_show, steps_store);
+static DEVICE_ATTR(direction, 0660, direction_show, direction_store);
+static DEVICE_ATTR(speed, 0660, speed_show, speed_store);
+static DEVICE_ATTR(policy, 0660, policy_show, policy_store);
+static DEVICE_ATTR(accel, 0660, accel_show, accel_store);
+static DEVICE_ATTR(jerk, 0660, jerk_show, jerk_store);
+static DEVICE_ATTR(position, 0660, position_show, position_store);
+static DEVICE_ATTR(target_position, 0660, target_position_show, target_position_store);
+static DEVICE_ATTR(ustep_auto, 0660, ustep_auto_show, ustep_auto_store);
+static DEVICE_ATTR(ustep_thresholds, 0660, ustep_thresholds_show, ustep_thresholds_store);
+static DEVICE_ATTR(encoder, 0660, encoder_show, encoder_store);
+static DEVICE_ATTR(encoder_ratio, 0660, encoder_ratio_show, encoder_ratio_store);
+static DEVICE_ATTR(loss_tolerance, 0660, loss_tolerance_show, loss_tolerance_store);
+static DEVICE_ATTR(loss_action, 0660, loss_action_show, loss_action_store);
+static DEVICE_ATTR(step_loss, S_IRUGO, step_loss_show, NULL);
+static DEVICE_ATTR(following_error, S_IRUGO, following_error_show, NULL);
+static DEVICE_ATTR(busy, S_IRUGO, busy_show, NULL);
+
+static struct attribute *a4988_attr[] = {
+	&dev_attr_enable.attr,
+	&dev_attr_sleep.attr,
+	&dev_attr_reset.attr,
+	&dev_attr_ustep.attr,
+	&dev_attr_steps.attr,
+	&dev_attr_direction.attr,
+	&dev_attr_speed.attr,
+	&dev_attr_policy.attr,
+	&dev_attr_accel.attr,
+	&dev_attr_jerk.attr,
+	&dev_attr_position.attr,
+	&dev_attr_target_position.attr,
+	&dev_attr_ustep_auto.attr,
+	&dev_attr_ustep_thresholds.attr,
+	&dev_attr_encoder.attr,
+	&dev_attr_encoder_ratio.attr,
+	&dev_attr_loss_tolerance.attr,
+	&dev_attr_loss_action.attr,
+	&dev_attr_step_loss.attr,
+	&dev_attr_following_error.attr,
+	&dev_attr_busy.attr,
+	NULL,
+};
+
+static const struct attribute_group a4988_attr_group = {
+	.attrs = a4988_attr,
+};
+
+/* character device */
+static int move_to_segment(struct a4988 *ax, const struct a4988_move *move, struct step_segment *seg)
+{
+	if(move->direction > 1)return -EINVAL;
+	if(move->ustep == 0 && (!ax->ustep_auto || move->rate))return -EINVAL;
+	if(move->ustep != 0 && move->ustep != 1 && move->ustep != 2 && move->ustep != 4 && move->ustep != 8 && move->ustep != 16)return -EINVAL;
+	if(move->rate > speed_limit(ax))return -EINVAL;
+	seg->steps = move->steps;
+	seg->interval = move->rate ? NSEC_PER_SEC / move->rate : 0;
+	seg->dir = move->direction;
+	seg->ustep = move->ustep;
+	return 0;
+}
+
+static void a4988_free(struct kref *ref)
+{
+	kfree(container_of(ref, struct a4988, ref));
+}
+
+/* the axis is looked up by minor, remove takes it out of axes[] before
+ * dropping its own reference */
+static int a4988_open(struct inode *inode, struct file *file)
+{
+	struct a4988 *ax;
+	int err = 0;
+
+	mutex_lock(&axes_mutex);
+	ax = iminor(inode) < A4988_AXES_MAX ? axes[iminor(inode)] : NULL;
+	if(ax){
+		kref_get(&ax->ref);
+		file->private_data = ax;
+	}
+	else err = -ENODEV;
+	mutex_unlock(&axes_mutex);
+	return err;
+}
+
+static int a4988_release(struct inode *inode, struct file *file)
+{
+	struct a4988 *ax = file->private_data;
+	kref_put(&ax->ref, a4988_free);
+	return 0;
+}
+
+static ssize_t a4988_write(struct file *file, const char __user *buf, size_t lbuf, loff_t *ppos)
+{
+	struct a4988 *ax = file->private_data;
+	struct a4988_move moves[WRITE_BATCH];
+	struct step_segment seg;
+	size_t done = 0, n, i;
+	ssize_t err = 0;
+
+	if(lbuf % sizeof(struct a4988_move))return -EINVAL;
+	if(mutex_lock_interruptible(&ax->step_mutex))return -ERESTARTSYS;
+	if(ax->gone){
+		mutex_unlock(&ax->step_mutex);
+		return -ENODEV;
+	}
+	while(done < lbuf){
+		n = min(lbuf - done, sizeof(moves));
+		if(copy_from_user(moves, buf + done, n)){
+			err = -EFAULT;
+			goto out;
+		}
+		for(i = 0; i < n / sizeof(struct a4988_move); i++){
+			err = move_to_segment(ax, &moves[i], &seg);
+			if(err)goto out;
+			while(seg.steps && !queue_segment(ax, &seg)){
+				if(file->f_flags & O_NONBLOCK){
+					err = -EAGAIN;
+					goto out;
+				}
+				if(wait_event_interruptible(ax->wait, !kfifo_is_full(&ax->queue))){
+					err = -ERESTARTSYS;
+					goto out;
+				}
+			}
+			done += sizeof(struct a4988_move);
+		}
+	}
+	out:
+	mutex_unlock(&ax->step_mutex);
+	return done ? done : err;
+}
+
+static long a4988_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct a4988 *ax = file->private_data;
+	struct step_segment seg;
+	s64 pos;
+	long err;
+
+	if(cmd == A4988_IOC_GET_POSITION){
+		pos = atomic64_read(&ax->position);
+		return copy_to_user((void __user *)arg, &pos, sizeof(pos)) ? -EFAULT : 0;
+	}
+	if(cmd != A4988_IOC_SET_POSITION && cmd != A4988_IOC_MOVE_TO)return -ENOTTY;
+	if(copy_from_user(&pos, (void __user *)arg, sizeof(pos)))return -EFAULT;
+	if(cmd == A4988_IOC_SET_POSITION)return set_position(ax, pos);
+
+	if(mutex_lock_interruptible(&ax->step_mutex))return -ERESTARTSYS;
+	err = ax->gone ? -ENODEV : plan_move_to(ax, pos, &seg);
+	while(!err && seg.steps && !queue_segment(ax, &seg)){
+		if(file->f_flags & O_NONBLOCK)err = -EAGAIN;
+		else if(wait_event_interruptible(ax->wait, !kfifo_is_full(&ax->queue)))err = -ERESTARTSYS;
+	}
+	mutex_unlock(&ax->step_mutex);
+	return err;
+}
+
+/* writable while there is room in the queue */
+static unsigned int a4988_poll(struct file *file, poll_table *wait)
+{
+	struct a4988 *ax = file->private_data;
+	poll_wait(file, &ax->wait, wait);
+	if(!kfifo_is_full(&ax->queue))return POLLOUT | POLLWRNORM;
+	return 0;
+}
+
+static const struct file_operations a4988_fops = {
+	.owner = THIS_MODULE,
+	.open = a4988_open,
+	.release = a4988_release,
+	.write = a4988_write,
+	.poll = a4988_poll,
+	.unlocked_ioctl = a4988_ioctl,
+	.llseek = no_llseek,
+};
+
+/* coordinator
+ * runs struct a4988_line moves written to /dev/a4988_line over all axes
+ * from one timer. Every tick is a step of the longest axis, the others
+ * step when their Bresenham error overflows, so all of them start and
+ * finish together. Axes driven by a PRU cannot take part. */
+static void line_load(const struct line_segment *l)
+{
+	struct a4988 *ax;
+	int i;
+
+	line_major = 0;
+	for(i = 0; i < A4988_AXES_MAX; i++){
+		ax = line_axes[i];
+		line_delta[i] = 0;
+		if(!ax || l->steps[i] == 0)continue;
+		ax->dir = l->steps[i] < 0;
+		ax->step_inc = step_increment(ax->dir, ax->ustep);
+		pin_set(ax, DIR_PIN, ax->dir);
+		line_delta[i] = abs(l->steps[i]);
+		line_major = max(line_major, line_delta[i]);
+	}
+	for(i = 0; i < A4988_AXES_MAX; i++)line_err[i] = line_major / 2;
+	/* an axis removed since the line was checked leaves an idle tick */
+	line_count = max(line_major, 1U);
+	line_interval = l->interval;
+}
+
+/* hands the claimed axes back, each starts what got queued meanwhile;
+ * called under line_lock, before anyone can claim them again */
+static void line_release(void)
+{
+	struct a4988 *ax;
+	int i;
+
+	for(i = 0; i < A4988_AXES_MAX; i++){
+		ax = line_axes[i];
+		line_axes[i] = NULL;
+		if(ax && next_segment(ax)){
+			ax->step_level = 0;
+			hrtimer_start(&ax->timer, ktime_set(0, 0), HRTIMER_MODE_REL);
+		}
+	}
+}
+
+/* drives STEP of the axes in line_stepped, with direct_gpio the axes
+ * sharing a bank get their edge from the same store */
+static void line_step_pins(int value)
+{
+	u32 mask[AM335X_GPIO_BANKS] = {0};
+	int i, b, pin;
+
+	for(i = 0; i < A4988_AXES_MAX; i++){
+		if(!(line_stepped & (1 << i)))continue;
+		pin = line_axes[i]->pins[STEP_PIN];
+		if(direct_gpio)mask[AM335X_GPIO_BANK(pin)] |= AM335X_GPIO_BIT(pin);
+		else gpio_set_value(pin, value);
+	}
+	for(b = 0; b < AM335X_GPIO_BANKS; b++)
+		if(mask[b])am335x_gpio_write(&gpio_regs, b, mask[b], value ? mask[b] : 0);
+}
+
+static enum hrtimer_restart line_timer_func(struct hrtimer *timer)
+{
+	struct line_segment l;
+	struct a4988 *ax;
+	int i;
+
+	jitter_record(&line_jitter, timer);
+	line_level = !line_level;
+	if(line_level){
+		line_stepped = 0;
+		for(i = 0; i < A4988_AXES_MAX; i++){
+			if(!line_delta[i])continue;
+			line_err[i] += line_delta[i];
+			if(line_err[i] >= line_major){
+				line_err[i] -= line_major;
+				line_stepped |= 1 << i;
+			}
+		}
+		line_step_pins(1);
+		jitter_forward(&line_jitter, timer, line_interval >> 1);
+		return HRTIMER_RESTART;
+	}
+	line_step_pins(0);
+	for(i = 0; i < A4988_AXES_MAX; i++){
+		if(!(line_stepped & (1 << i)))continue;
+		ax = line_axes[i];
+		atomic64_add(ax->step_inc, &ax->position);
+		ax->phase = (ax->phase + ax->step_inc) & (PHASE_CYCLE - 1);
+	}
+	if(--line_count == 0){
+		spin_lock(&line_lock);
+		if(!kfifo_get(&line_queue, &l)){
+			line_release();
+			line_busy = 0;
+			spin_unlock(&line_lock);
+			wake_up_interruptible(&line_wait);
+			schedule_work(&line_work);
+			return HRTIMER_NORESTART;
+		}
+		line_load(&l);
+		spin_unlock(&line_lock);
+		wake_up_interruptible(&line_wait);
+	}
+	jitter_forward(&line_jitter, timer, line_interval - (line_interval >> 1));
+	return HRTIMER_RESTART;
+}
+
+static void line_notify(struct work_struct *work)
+{
+	sysfs_notify(&line_dev->kobj, NULL, "busy");
+}
+
+/* marks the axes l moves busy on behalf of the coordinator, those it
+ * already holds are kept; fails if one of them is gone or running its
+ * own moves.
+ * Axes l leaves alone stay free for their own generators. */
+static int line_claim(const struct line_segment *l)
+{
+	struct a4988 *ax;
+	unsigned long flags;
+	int i, held, err = 0;
+
+	mutex_lock(&axes_mutex);
+	for(i = 0; i < A4988_AXES_MAX; i++){
+		ax = axes[i];
+		if(l->steps[i] == 0)continue;
+		/* removed since line_to_segment() looked */
+		if(!ax || !soft_steps(ax)){
+			err = -ENODEV;
+			break;
+		}
+		spin_lock_irqsave(&line_lock, flags);
+		held = line_axes[i] != NULL;
+		spin_unlock_irqrestore(&line_lock, flags);
+		if(held)continue;
+		spin_lock_irqsave(&ax->queue_lock, flags);
+		if(ax->busy)err = -EBUSY;
+		else{
+			ax->busy = 1;
+			ax->queued_position = atomic64_read(&ax->position);
+		}
+		spin_unlock_irqrestore(&ax->queue_lock, flags);
+		if(err)break;
+		spin_lock_irqsave(&line_lock, flags);
+		line_axes[i] = ax;
+		spin_unlock_irqrestore(&line_lock, flags);
+		schedule_work(&ax->busy_work);
+	}
+	mutex_unlock(&axes_mutex);
+	/* a running line hands them back when it ends */
+	if(err){
+		spin_lock_irqsave(&line_lock, flags);
+		if(!line_busy)line_release();
+		spin_unlock_irqrestore(&line_lock, flags);
+	}
+	return err;
+}
+
+/* whether every axis l moves is claimed, called under line_lock */
+static int line_claimed(const struct line_segment *l)
+{
+	int i;
+
+	for(i = 0; i < A4988_AXES_MAX; i++)
+		if(l->steps[i] && !line_axes[i])return 0;
+	return 1;
+}
+
+/* where the line leaves the claimed axes, called under line_lock */
+static void line_account(const struct line_segment *l)
+{
+	struct a4988 *ax;
+	int i;
+
+	for(i = 0; i < A4988_AXES_MAX; i++){
+		ax = line_axes[i];
+		if(!ax)continue;
+		spin_lock(&ax->queue_lock);
+		ax->queued_position += (s64)l->steps[i] * step_increment(0, ax->ustep);
+		spin_unlock(&ax->queue_lock);
+	}
+}
+
+/* claims what l needs, then queues it or starts it when the coordinator
+ * is idle; returns 0 when the queue is full. Called with line_mutex held,
+ * only this path leaves the idle state. */
+static int line_queue_segment(const struct line_segment *l)
+{
+	unsigned long flags;
+	int ret;
+
+	for(;;){
+		ret = line_claim(l);
+		if(ret)return ret;
+		spin_lock_irqsave(&line_lock, flags);
+		/* the line ended meanwhile and handed back what l needs */
+		if(line_claimed(l))break;
+		spin_unlock_irqrestore(&line_lock, flags);
+	}
+	if(line_busy){
+		ret = kfifo_put(&line_queue, l);
+		if(ret)line_account(l);
+		spin_unlock_irqrestore(&line_lock, flags);
+		return ret;
+	}
+	line_account(l);
+	line_load(l);
+	line_level = 0;
+	line_busy = 1;
+	hrtimer_start(&line_timer, ktime_set(0, 0), HRTIMER_MODE_REL);
+	spin_unlock_irqrestore(&line_lock, flags);
+	schedule_work(&line_work);
+	return 1;
+}
+
+/* every moving axis has to exist and be driven by the hrtimer */
+static int line_to_segment(const struct a4988_line *line, struct line_segment *l)
+{
+	int i, err = 0;
+
+	if(line->rate == 0 || line->rate > SPEED_MAX)return -EINVAL;
+	mutex_lock(&axes_mutex);
+	for(i = 0; i < A4988_AXES_MAX; i++){
+		l->steps[i] = line->steps[i];
+		if(line->steps[i] && (!axes[i] || !soft_steps(axes[i])))err = -ENODEV;
+	}
+	mutex_unlock(&axes_mutex);
+	l->interval = NSEC_PER_SEC / line->rate;
+	return err;
+}
+
+static ssize_t line_write(struct file *file, const char __user *buf, size_t lbuf, loff_t *ppos)
+{
+	struct a4988_line lines[WRITE_BATCH];
+	struct line_segment l;
+	size_t done = 0, n, i;
+	ssize_t err = 0;
+	int j, ret, moving;
+
+	if(lbuf % sizeof(struct a4988_line))return -EINVAL;
+	if(mutex_lock_interruptible(&line_mutex))return -ERESTARTSYS;
+	while(done < lbuf){
+		n = min(lbuf - done, sizeof(lines));
+		if(copy_from_user(lines, buf + done, n)){
+			err = -EFAULT;
+			goto out;
+		}
+		for(i = 0; i < n / sizeof(struct a4988_line); i++){
+			err = line_to_segment(&lines[i], &l);
+			if(err)goto out;
+			for(j = 0, moving = 0; j < A4988_AXES_MAX; j++)moving |= l.steps[j];
+			while(moving && (ret = line_queue_segment(&l)) <= 0){
+				if(ret < 0){
+					err = ret;
+					goto out;
+				}
+				if(file->f_flags & O_NONBLOCK){
+					err = -EAGAIN;
+					goto out;
+				}
+				if(wait_event_interruptible(line_wait, !kfifo_is_full(&line_queue))){
+					err = -ERESTARTSYS;
+					goto out;
+				}
+			}
+			done += sizeof(struct a4988_line);
+		}
+	}
+	out:
+	mutex_unlock(&line_mutex);
+	return done ? done : err;
+}
+
+static unsigned int line_poll(struct file *file, poll_table *wait)
+{
+	poll_wait(file, &line_wait, wait);
+	if(!kfifo_is_full(&line_queue))return POLLOUT | POLLWRNORM;
+	return 0;
+}
+
+/* an axis is going away, coordinated moves stop with it */
+static void line_stop(void)
+{
+	unsigned long flags;
+	int i;
+
+	mutex_lock(&line_mutex);
+	hrtimer_cancel(&line_timer);
+	spin_lock_irqsave(&line_lock, flags);
+	if(line_busy){
+		line_step_pins(0);
+		line_release();
+		kfifo_reset(&line_queue);
+		line_busy = 0;
+		wake_up_interruptible(&line_wait);
+		schedule_work(&line_work);
+	}
+	spin_unlock_irqrestore(&line_lock, flags);
+	mutex_unlock(&line_mutex);
+}
+
+static ssize_t line_busy_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%i", line_busy);
+}
+
+static struct device_attribute line_busy_attr = __ATTR(busy, S_IRUGO, line_busy_show, NULL);
+
+static const struct file_operations line_fops = {
+	.owner = THIS_MODULE,
+	.write = line_write,
+	.poll = line_poll,
+	.llseek = no_llseek,
+};
+
+/* platform driver */
+static int a4988_probe(struct platform_device *pdev)
+{
+	struct device_node *np = pdev->dev.of_node;
+	struct a4988 *ax;
+	char prop[16];
+	u32 pru;
+	int i, err, fail = 0;
+
+	ax = kzalloc(sizeof(struct a4988), GFP_KERNEL);
+	if(!ax){
+		printk(KERN_ERR "%s: %s: cannot allocate memory\n", DRVNAME, __func__);
+		return -ENOMEM;
+	}
+	kref_init(&ax->ref);
+	ax->enable = 1;
+	ax->ustep = 1;
+	ax->speed = SPEED_DEFAULT;
+	ax->policy = POLICY_REJECT;
+	ax->pru = -1;
+	ax->pwm_id = -1;
+	memcpy(ax->auto_threshold, auto_threshold_default, sizeof(ax->auto_threshold));
+	auto_intervals(ax);
+	ax->encoder = -1;
+	ax->enc_counts = ENC_COUNTS_DEFAULT;
+	ax->enc_steps = ENC_STEPS_DEFAULT;
+	ax->enc_scale = div_u64(((u64)ENC_STEPS_DEFAULT * A4988_USTEP_MAX) << 16, ENC_COUNTS_DEFAULT);
+	ax->loss_tolerance = LOSS_TOLERANCE_DEFAULT;
+	if(of_property_read_u32(np, "pru", &pru) == 0)ax->pru = pru;
+	if(ax->pru > 1){
+		printk(KERN_ERR "%s: %s: invalid pru %i\n", DRVNAME, __func__, ax->pru);
+		err = -EINVAL;
+		goto err1;
+	}
+	if(of_property_read_u32(np, "pwm", &pru) == 0)ax->pwm_id = pru;
+	if(ax->pwm_id >= 0 && ax->pru >= 0){
+		printk(KERN_ERR "%s: %s: pru and pwm exclude each other\n", DRVNAME, __func__);
+		err = -EINVAL;
+		goto err1;
+	}
+	/* a move is ended from the interrupt through the ePWM registers */
+	if(ax->pwm_id >= 0 && !AM335X_EHRPWM_VALID(ax->pwm_id)){
+		printk(KERN_ERR "%s: %s: pwm %i is not an ehrpwm output\n", DRVNAME, __func__, ax->pwm_id);
+		err = -EINVAL;
+		goto err1;
+	}
+	mutex_init(&ax->step_mutex);
+	spin_lock_init(&ax->queue_lock);
+	init_waitqueue_head(&ax->wait);
+	INIT_WORK(&ax->busy_work, busy_notify);
+	INIT_WORK(&ax->loss_work, loss_handle);
+	jitter_init(&ax->jitter);
+	INIT_KFIFO(ax->queue);
+	build_ramp(ax);
+	hrtimer_init(&ax->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	ax->timer.function = ax->pru < 0 ? step_timer_func : pru_refill_func;
+
+	/* the axis registers under axes_mutex only when fully set up */
+	mutex_lock(&axes_mutex);
+	for(ax->id = 0; ax->id < A4988_AXES_MAX && axes[ax->id]; ax->id++);
+	if(ax->id == A4988_AXES_MAX){
+		printk(KERN_ERR "%s: %s: too many axes\n", DRVNAME, __func__);
+		err = -ENOSPC;
+		goto err2;
+	}
+
+	for(i = 0; i < PINS_AMOUNT; i++)
+	{
+		sprintf(prop, "%s-gpio", pins_names[i]);
+		ax->pins[i] = of_get_named_gpio(np, prop, 0);
+		if(direct_gpio && !AM335X_GPIO_VALID(ax->pins[i]))ax->pins[i] = -EINVAL;
+		if(!gpio_is_valid(ax->pins[i]) || gpio_request(ax->pins[i], pins_names[i]) != 0){
+			printk(KERN_ERR "%s: GPIO %s cannot be requested\n", DRVNAME, prop);
+			fail = i;
+			err = -ENODEV;
+			goto err3;
+		}
+		/* with a PWM the STEP gpio only listens to it */
+		if(i == STEP_PIN && ax->pwm_id >= 0)gpio_direction_input(ax->pins[i]);
+		else gpio_direction_output(ax->pins[i], pins_init_val[i]);
+		gpio_export(ax->pins[i], 0);
+	}
+	fail = PINS_AMOUNT;
+
+	/* allocated apart, an open racing remove may hold it past the axis */
+	ax->cdev = cdev_alloc();
+	if(!ax->cdev){
+		err = -ENOMEM;
+		goto err3;
+	}
+	ax->cdev->owner = THIS_MODULE;
+	ax->cdev->ops = &a4988_fops;
+	err = cdev_add(ax->cdev, MKDEV(MAJOR(a4988_devt), ax->id), 1);
+	if(err){
+		printk(KERN_ERR "%s: %s: cdev_add failed(%i)\n", DRVNAME, __func__, err);
+		kobject_put(&ax->cdev->kobj);
+		goto err3;
+	}
+	ax->dev = device_create(a4988_class, &pdev->dev, MKDEV(MAJOR(a4988_devt), ax->id), ax, "a4988_%i", ax->id);
+	if(IS_ERR(ax->dev)){
+		printk(KERN_ERR "%s: %s: cannot create device\n", DRVNAME, __func__);
+		err = PTR_ERR(ax->dev);
+		goto err4;
+	}
+	err = sysfs_create_group(&ax->dev->kobj, &a4988_attr_group);
+	if(err){
+		printk(KERN_ERR "%s: %s: cannot create sysfs entry(%i)\n", DRVNAME, __func__, err);
+		goto err5;
+	}
+	if(ax->pru >= 0){
+		err = pru_start(ax);
+		if(err)goto err6;
+	}
+	if(ax->pwm_id >= 0){
+		err = pwm_start(ax);
+		if(err)goto err6;
+	}
+
+	/* only the hrtimer generator is measured, PRU and PWM time their own edges */
+	if(a4988_debugfs && soft_steps(ax)){
+		sprintf(prop, "a4988_%i", ax->id);
+		ax->debugfs = debugfs_create_dir(prop, a4988_debugfs);
+		if(!IS_ERR_OR_NULL(ax->debugfs))debugfs_create_file("jitter", 0600, ax->debugfs, &ax->jitter, &jitter_fops);
+	}
+
+	axes[ax->id] = ax;
+	mutex_unlock(&axes_mutex);
+	platform_set_drvdata(pdev, ax);
+	printk(KERN_INFO "%s: %s: axis %i\n", DRVNAME, __func__, ax->id);
+	return 0;
+
+	err6:
+	sysfs_remove_group(&ax->dev->kobj, &a4988_attr_group);
+	err5:
+	device_destroy(a4988_class, MKDEV(MAJOR(a4988_devt), ax->id));
+	err4:
+	cdev_del(ax->cdev);
+	err3:
+	for(i = 0; i < fail; i++)
+	{
+		gpio_set_value(ax->pins[i], 0);
+		gpio_unexport(ax->pins[i]);
+		gpio_free(ax->pins[i]);
+	}
+	err2:
+	mutex_unlock(&axes_mutex);
+	err1:
+	kref_put(&ax->ref, a4988_free);
+	return err;
+}
+
+static int a4988_remove(struct platform_device *pdev)
+{
+	struct a4988 *ax = platform_get_drvdata(pdev);
+	int i;
+
+	mutex_lock(&axes_mutex);
+	axes[ax->id] = NULL;
+	mutex_unlock(&axes_mutex);
+	line_stop();
+	sysfs_remove_group(&ax->dev->kobj, &a4988_attr_group);
+
+	/* a retrying loss handler restarts the timer, so it must not retry
+	 * anymore and has to be gone before the timer is cancelled; the
+	 * timer may queue it once more on its way out */
+	mutex_lock(&ax->step_mutex);
+	if(ax->loss_action == LOSS_RETRY)ax->loss_action = LOSS_STOP;
+	/* files still open get -ENODEV from here on */
+	ax->gone = 1;
+	mutex_unlock(&ax->step_mutex);
+	wake_up_interruptible(&ax->wait);
+	cancel_work_sync(&ax->loss_work);
+	hrtimer_cancel(&ax->timer);
+	cancel_work_sync(&ax->loss_work);
+	cancel_work_sync(&ax->busy_work);
+	if(ax->encoder_edges)symbol_put(dagu_encoder_edges);
+	if(!IS_ERR_OR_NULL(ax->debugfs))debugfs_remove_recursive(ax->debugfs);
+	if(ax->pru >= 0)pru_stop(ax);
+	if(ax->pwm_id >= 0)pwm_stop(ax);
+	device_destroy(a4988_class, MKDEV(MAJOR(a4988_devt), ax->id));
+	cdev_del(ax->cdev);
+	for(i = 0; i < PINS_AMOUNT; i++)
+	{
+		gpio_set_value(ax->pins[i], 0);
+		gpio_unexport(ax->pins[i]);
+		gpio_free(ax->pins[i]);
+	}
+	platform_set_drvdata(pdev, NULL);
+	printk(KERN_INFO "%s: %s: axis %i\n", DRVNAME, __func__, ax->id);
+	kref_put(&ax->ref, a4988_free);
+	return 0;
+}
+
+static const struct of_device_id a4988_of_match[] = {
+	{ .compatible = "allegro,a4988", },
+	{},
+};
+
+static struct platform_driver a4988_driver = {
+	.driver = {
+		.name = "a4988",
+		.owner = THIS_MODULE,
+		.of_match_table = a4988_of_match,
+	},
+	.probe = a4988_probe,
+	.remove = a4988_remove,
+};
 
 static int __init a4988_init(void)
 {
-	int i, fail;
+	int err;
 	/* create entries in sysfs */
 	a4988_class = class_create(THIS_MODULE, "a4988");
 	if(a4988_class == NULL){
 		printk(KERN_ERR "%s: Cannot create entry in sysfs", DRVNAME);
 		return -1;
 	}
-	
-	if(class_create_file(a4988_class, &enable_attr) != 0){
-		printk(KERN_ERR "%s: Cannot create sysfs attribute\n", DRVNAME);
+	if(alloc_chrdev_region(&a4988_devt, 0, A4988_AXES_MAX + 1, "a4988") < 0){
+		printk(KERN_ERR "%s: alloc_chrdev_region failed\n", DRVNAME);
 		goto err1;
 	}
-	
-	if(class_create_file(a4988_class, &sleep_attr) != 0){
-		printk(KERN_ERR "%s: Cannot create sysfs attribute\n", DRVNAME);
+	if(direct_gpio && am335x_gpio_map(&gpio_regs) != 0){
+		printk(KERN_ERR "%s: Cannot map GPIO registers\n", DRVNAME);
 		goto err2;
 	}
-	if(class_create_file(a4988_class, &reset_attr) != 0){
-		printk(KERN_ERR "%s: Cannot create sysfs attribute\n", DRVNAME);
+
+	/* coordinator */
+	INIT_KFIFO(line_queue);
+	jitter_init(&line_jitter);
+	hrtimer_init(&line_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	line_timer.function = line_timer_func;
+	cdev_init(&line_cdev, &line_fops);
+	if(cdev_add(&line_cdev, MKDEV(MAJOR(a4988_devt), A4988_AXES_MAX), 1) < 0){
+		printk(KERN_ERR "%s: cdev_add failed\n", DRVNAME);
+		goto err2;
+	}
+	line_dev = device_create(a4988_class, NULL, MKDEV(MAJOR(a4988_devt), A4988_AXES_MAX), NULL, "a4988_line");
+	if(IS_ERR(line_dev)){
+		printk(KERN_ERR "%s: Cannot create device\n", DRVNAME);
 		goto err3;
 	}
-	if(class_create_file(a4988_class, &ustep_attr) != 0){
+	if(device_create_file(line_dev, &line_busy_attr) != 0){
 		printk(KERN_ERR "%s: Cannot create sysfs attribute\n", DRVNAME);
 		goto err4;
 	}
-	if(class_create_file(a4988_class, &steps_attr) != 0){
-		printk(KERN_ERR "%s: Cannot create sysfs attribute\n", DRVNAME);
+
+	/* step timing statistics, the driver works without them */
+	a4988_debugfs = debugfs_create_dir("a4988", NULL);
+	if(IS_ERR_OR_NULL(a4988_debugfs))a4988_debugfs = NULL;
+	else debugfs_create_file("line_jitter", 0600, a4988_debugfs, &line_jitter, &jitter_fops);
+
+	err = platform_driver_register(&a4988_driver);
+	if(err){
+		printk(KERN_ERR "%s: Cannot register platform driver(%i)\n", DRVNAME, err);
 		goto err5;
 	}
-	if(class_create_file(a4988_class, &direction_attr) != 0){
-		printk(KERN_ERR "%s: Cannot create sysfs attribute\n", DRVNAME);
-		goto err6;
-	}
-	for(i = 0; i < PINS_AMOUNT; i++)
-	{
-		if(gpio_request(pins[i], pins_names[i]) != 0){
-			printk(KERN_ERR "%s: GPIO pin %i cannot be requested\n", DRVNAME, ENABLE_PIN);
-			fail = i;
-			goto err7;
-		}
-		gpio_direction_output(pins[i], pins_init_val[i]);
-		gpio_export(pins[i], 0);
-	}
-	strcpy(direction, "cw");
 	printk(KERN_INFO "%s: Module loaded\n", DRVNAME);
 	return 0;
-	err7:
-	for(i = 0; i < fail; i++)
-	{
-		gpio_set_value(pins[i], 0);
-		gpio_unexport(pins[i]);
-		gpio_free(pins[i]);
-	}
-	class_remove_file(a4988_class, &direction_attr);
-	err6:
-	class_remove_file(a4988_class, &steps_attr);
 	err5:
-	class_remove_file(a4988_class, &ustep_attr);
+	if(a4988_debugfs)debugfs_remove_recursive(a4988_debugfs);
+	device_remove_file(line_dev, &line_busy_attr);
 	err4:
-	class_remove_file(a4988_class, &reset_attr);
+	device_destroy(a4988_class, MKDEV(MAJOR(a4988_devt), A4988_AXES_MAX));
 	err3:
-	class_remove_file(a4988_class, &sleep_attr);
+	cdev_del(&line_cdev);
 	err2:
-	class_remove_file(a4988_class, &enable_attr);
+	if(direct_gpio)am335x_gpio_unmap(&gpio_regs);
+	unregister_chrdev_region(a4988_devt, A4988_AXES_MAX + 1);
 	err1:
 	class_destroy(a4988_class);
 	return -1;
 }
 
 static void __exit a4988_exit(void)
-{	
-	int i;
-	for(i = 0; i < PINS_AMOUNT; i++)
-	{
-		gpio_set_value(pins[i], 0);
-		gpio_unexport(pins[i]);
-		gpio_free(pins[i]);
-	}
-	class_remove_file(a4988_class, &direction_attr);
-	class_remove_file(a4988_class, &steps_attr);
-	class_remove_file(a4988_class, &ustep_attr);
-	class_remove_file(a4988_class, &reset_attr);
-	class_remove_file(a4988_class, &sleep_attr);
-	class_remove_file(a4988_class, &enable_attr);
+{
+	platform_driver_unregister(&a4988_driver);
+	if(a4988_debugfs)debugfs_remove_recursive(a4988_debugfs);
+	hrtimer_cancel(&line_timer);
+	cancel_work_sync(&line_work);
+	device_remove_file(line_dev, &line_busy_attr);
+	device_destroy(a4988_class, MKDEV(MAJOR(a4988_devt), A4988_AXES_MAX));
+	cdev_del(&line_cdev);
+	if(direct_gpio)am335x_gpio_unmap(&gpio_regs);
+	unregister_chrdev_region(a4988_devt, A4988_AXES_MAX + 1);
 	class_destroy(a4988_class);
 	printk(KERN_INFO "%s: Module unloaded\n", DRVNAME);
 }
@@ -266,6 +2307,8 @@ static void __exit a4988_exit(void)
 module_init(a4988_init);
 module_exit(a4988_exit);
 
+MODULE_DEVICE_TABLE(of, a4988_of_match);
+
 MODULE_AUTHOR("Adam Olek");
 MODULE_DESCRIPTION("A4988 steppermotor driver");
 MODULE_LICENSE("GPL");
@@ -0,0 +1,38 @@
+#ifndef A4988_H
+#define A4988_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/* positions are counted in 1/A4988_USTEP_MAX steps whatever the microstep
+ * mode, cw is positive */
+#define A4988_USTEP_MAX 16
+/* axes probed from the devicetree, /dev/a4988_0 to /dev/a4988_3 */
+#define A4988_AXES_MAX 4
+
+/* record written to /dev/a4988_N, one write() may carry any number of them
+ * and the driver runs them back to back */
+struct a4988_move {
+	__u8 direction;	/* 0 - cw, 1 - ccw */
+	__u8 ustep;	/* 1, 2, 4, 8 or 16; 0 - automatic, see ustep_auto, steps
+			 * then in 1/A4988_USTEP_MAX and rate has to be 0 */
+	__u16 reserved;
+	__u32 steps;
+	__u32 rate;	/* steps/s, 0 - profile planned from speed, accel and jerk */
+} __attribute__((packed));
+
+/* record written to /dev/a4988_line, a straight move of all axes together;
+ * steps[N] drives a4988_N at its current microstep mode, negative is ccw */
+struct a4988_line {
+	__s32 steps[A4988_AXES_MAX];
+	__u32 rate;	/* steps/s of the axis moving the most */
+} __attribute__((packed));
+
+#define A4988_IOC_MAGIC 'a'
+#define A4988_IOC_GET_POSITION _IOR(A4988_IOC_MAGIC, 1, __s64)
+/* only while no move is running */
+#define A4988_IOC_SET_POSITION _IOW(A4988_IOC_MAGIC, 2, __s64)
+/* queues a planned move from the end of the queue to the position */
+#define A4988_IOC_MOVE_TO _IOW(A4988_IOC_MAGIC, 3, __s64)
+
+#endif
@@ -0,0 +1,133 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "gcode.h"
+
+#define LINE_DEVICE "/dev/a4988_line"
+#define TEXT_MAX 256
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-d device] [-s steps_per_mm,...] [-f max_feed] [-a accel]\n"
+		"\t[-j junction_deviation] [-r max_rate] [-c chunk_ms] [-p fifo | program...]\n"
+		"G-code from the programs, stdin, or every program written to fifo\n", name);
+}
+
+/* one program, streamed to the end and flushed to standstill */
+static int run(struct planner *p, struct gcode *g, FILE *in, const char *name)
+{
+	char text[TEXT_MAX];
+	int err = 0;
+
+	g->line = 0;
+	while(fgets(text, sizeof(text), in) != NULL){
+		err = gcode_line(g, text);
+		if(err < 0){
+			fprintf(stderr, "%s:%i: %s\n", name, g->line, strerror(-err));
+			break;
+		}
+		if(err == 1){
+			err = 0;
+			break;
+		}
+	}
+	if(planner_flush(p) < 0 && err == 0)err = -EIO;
+	return err;
+}
+
+int main(int argc, char **argv)
+{
+	struct planner_config cfg;
+	struct planner *p;
+	struct gcode g;
+	const char *device = LINE_DEVICE, *fifo = NULL;
+	char *list, *tok;
+	FILE *in;
+	int fd, opt, i, err = 0;
+
+	planner_defaults(&cfg);
+	while((opt = getopt(argc, argv, "d:s:f:a:j:r:c:p:h")) != -1){
+		switch(opt){
+			case 'd':
+				device = optarg;
+				break;
+			case 's':
+				list = optarg;
+				for(i = 0; i < PLANNER_AXES && (tok = strsep(&list, ",")) != NULL; i++)
+					cfg.steps_per_mm[i] = atof(tok);
+				break;
+			case 'f':
+				cfg.max_feed = atof(optarg);
+				break;
+			case 'a':
+				cfg.accel = atof(optarg);
+				break;
+			case 'j':
+				cfg.junction_deviation = atof(optarg);
+				break;
+			case 'r':
+				cfg.max_rate = atof(optarg);
+				break;
+			case 'c':
+				cfg.chunk_time = atof(optarg) / 1000;
+				break;
+			case 'p':
+				fifo = optarg;
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	if(cfg.max_feed <= 0 || cfg.accel <= 0 || cfg.junction_deviation < 0 || cfg.max_rate < 1 || cfg.chunk_time <= 0){
+		usage(argv[0]);
+		return 1;
+	}
+
+	fd = open(device, O_WRONLY);
+	if(fd < 0){
+		perror(device);
+		return 1;
+	}
+	p = planner_open(&cfg, fd);
+	if(p == NULL){
+		perror("planner");
+		return 1;
+	}
+	gcode_init(&g, p);
+
+	if(fifo != NULL){
+		/* reopened after every writer closes it */
+		for(;;){
+			in = fopen(fifo, "r");
+			if(in == NULL){
+				perror(fifo);
+				err = 1;
+				break;
+			}
+			run(p, &g, in, fifo);
+			fclose(in);
+		}
+	}
+	else if(optind == argc)err = run(p, &g, stdin, "stdin") < 0;
+	else{
+		for(i = optind; i < argc && err == 0; i++){
+			in = fopen(argv[i], "r");
+			if(in == NULL){
+				perror(argv[i]);
+				err = 1;
+				break;
+			}
+			err = run(p, &g, in, argv[i]) < 0;
+			fclose(in);
+		}
+	}
+
+	planner_close(p);
+	close(fd);
+	return err;
+}
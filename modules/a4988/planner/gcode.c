@@ -0,0 +1,121 @@
+#include <ctype.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gcode.h"
+
+#define MM_PER_INCH 25.4
+
+static const char axis_letters[PLANNER_AXES] = {'X', 'Y', 'Z', 'A'};
+
+void gcode_init(struct gcode *g, struct planner *p)
+{
+	memset(g, 0, sizeof(struct gcode));
+	g->planner = p;
+	g->motion = 0;
+	g->scale = 1;
+	planner_get_position(p, g->position);
+}
+
+static int gcode_axis(char letter)
+{
+	int i;
+	for(i = 0; i < PLANNER_AXES; i++)
+		if(axis_letters[i] == letter)return i;
+	return -1;
+}
+
+int gcode_line(struct gcode *g, const char *text)
+{
+	double value, words[PLANNER_AXES], target[PLANNER_AXES];
+	int has[PLANNER_AXES] = {0}, any = 0, set_origin = 0, end = 0;
+	int i, code, comment = 0;
+	const char *c = text;
+	char letter, *next;
+
+	g->line++;
+	while(*c){
+		if(comment){
+			if(*c++ == ')')comment = 0;
+			continue;
+		}
+		if(*c == '('){
+			comment = 1;
+			c++;
+			continue;
+		}
+		if(*c == ';')break;
+		if(isspace((unsigned char)*c)){
+			c++;
+			continue;
+		}
+		letter = toupper((unsigned char)*c++);
+		value = strtod(c, &next);
+		if(next == c)return -EINVAL;
+		c = next;
+		code = (int)value;
+
+		if(letter == 'G'){
+			if(value != code)return -EINVAL;
+			switch(code){
+				case 0:
+				case 1:
+					g->motion = code;
+					break;
+				case 20:
+					g->scale = MM_PER_INCH;
+					break;
+				case 21:
+					g->scale = 1;
+					break;
+				case 90:
+					g->relative = 0;
+					break;
+				case 91:
+					g->relative = 1;
+					break;
+				case 92:
+					set_origin = 1;
+					break;
+				default:
+					return -EINVAL;
+			}
+		}
+		else if(letter == 'M'){
+			if(code == 2 || code == 30)end = 1;
+			else return -EINVAL;
+		}
+		else if(letter == 'F'){
+			if(value <= 0)return -EINVAL;
+			g->feed = value * g->scale / 60;
+		}
+		else if(letter == 'N')continue;
+		else{
+			i = gcode_axis(letter);
+			if(i < 0)return -EINVAL;
+			words[i] = value * g->scale;
+			has[i] = 1;
+			any = 1;
+		}
+	}
+
+	/* G92 names the current position in program coordinates */
+	if(set_origin){
+		for(i = 0; i < PLANNER_AXES; i++)
+			if(has[i])g->offset[i] = g->position[i] - words[i];
+	}
+	else if(any){
+		for(i = 0; i < PLANNER_AXES; i++){
+			target[i] = g->position[i];
+			if(!has[i])continue;
+			target[i] = g->relative ? g->position[i] + words[i] : words[i] + g->offset[i];
+		}
+		/* G0 goes at the planner top speed, G1 needs a feed */
+		if(g->motion == 1 && g->feed == 0)return -EINVAL;
+		i = planner_line(g->planner, target, g->motion == 0 ? 1e9 : g->feed);
+		if(i)return i;
+		memcpy(g->position, target, sizeof(target));
+	}
+	return end;
+}
@@ -0,0 +1,24 @@
+#ifndef GCODE_H
+#define GCODE_H
+
+#include "planner.h"
+
+/* the subset understood: G0, G1, G20, G21, G90, G91, G92, M2, M30 and
+ * X, Y, Z, A for axes 0-3, F in units/min, comments in () and after ; */
+struct gcode {
+	struct planner *planner;
+	int motion;	/* modal G0 or G1 */
+	int relative;	/* G91 */
+	double scale;	/* mm per program unit */
+	double feed;	/* mm/s */
+	double position[PLANNER_AXES];	/* mm, machine, where the last move ends */
+	double offset[PLANNER_AXES];	/* G92, program = machine - offset */
+	int line;
+};
+
+void gcode_init(struct gcode *g, struct planner *p);
+
+/* runs one line of a program, returns 1 after M2/M30, 0 or -errno */
+int gcode_line(struct gcode *g, const char *text);
+
+#endif
@@ -0,0 +1,246 @@
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "planner.h"
+
+/* records collected before one write() */
+#define WRITE_BATCH 64
+
+/* one queued straight move */
+struct block {
+	long steps[PLANNER_AXES];	/* relative, at the axis microstep mode */
+	double length;			/* mm */
+	double unit[PLANNER_AXES];	/* direction */
+	double nominal;			/* mm/s, feed limited by the step rate */
+	double max_entry;		/* mm/s, corner limit with the block before */
+	double entry;			/* mm/s, planned */
+};
+
+struct planner {
+	struct planner_config cfg;
+	int fd;
+	/* window[head] is the oldest block, its entry speed is fixed because
+	 * the block before it has already been streamed ending at it */
+	struct block window[PLANNER_WINDOW];
+	int head, count;
+	double position[PLANNER_AXES];	/* mm, where the last queued block ends */
+	long steps[PLANNER_AXES];	/* the same in steps */
+	struct a4988_line out[WRITE_BATCH];
+	int out_len;
+};
+
+void planner_defaults(struct planner_config *cfg)
+{
+	int i;
+	for(i = 0; i < PLANNER_AXES; i++)cfg->steps_per_mm[i] = 80;
+	cfg->max_feed = 100;
+	cfg->accel = 1000;
+	cfg->junction_deviation = 0.02;
+	cfg->max_rate = 40000;
+	cfg->chunk_time = 0.005;
+}
+
+struct planner *planner_open(const struct planner_config *cfg, int fd)
+{
+	struct planner *p;
+	p = calloc(1, sizeof(struct planner));
+	if(p == NULL)return NULL;
+	p->cfg = *cfg;
+	p->fd = fd;
+	return p;
+}
+
+static struct block *planner_block(struct planner *p, int i)
+{
+	return &p->window[(p->head + i) % PLANNER_WINDOW];
+}
+
+static int planner_write(struct planner *p)
+{
+	const char *buf = (const char *)p->out;
+	size_t len = p->out_len * sizeof(struct a4988_line);
+	ssize_t n;
+
+	while(len){
+		n = write(p->fd, buf, len);
+		if(n < 0){
+			if(errno == EINTR)continue;
+			return -errno;
+		}
+		buf += n;
+		len -= n;
+	}
+	p->out_len = 0;
+	return 0;
+}
+
+static int planner_emit(struct planner *p, const long *delta, long major, double dt)
+{
+	struct a4988_line *l = &p->out[p->out_len++];
+	double rate = major / dt;
+	int i;
+
+	for(i = 0; i < PLANNER_AXES; i++)l->steps[i] = delta[i];
+	if(rate > p->cfg.max_rate)rate = p->cfg.max_rate;
+	l->rate = rate < 1 ? 1 : lround(rate);
+	if(p->out_len == WRITE_BATCH)return planner_write(p);
+	return 0;
+}
+
+/* corner speed from the junction deviation: the fastest the path can take
+ * an arc of that deviation touching both moves at the given acceleration */
+static double junction_speed(const struct planner_config *cfg, const struct block *prev, const struct block *b)
+{
+	double cos_theta = 0, sin_half, v;
+	int i;
+
+	for(i = 0; i < PLANNER_AXES; i++)cos_theta -= prev->unit[i] * b->unit[i];
+	v = fmin(prev->nominal, b->nominal);
+	if(cos_theta > 0.999999)return 0;	/* reversal */
+	if(cos_theta < -0.999999)return v;	/* straight on */
+	sin_half = sqrt(0.5 * (1 - cos_theta));
+	return fmin(v, sqrt(cfg->accel * cfg->junction_deviation * sin_half / (1 - sin_half)));
+}
+
+/* entry speeds for the window: backwards from a stop after the last block,
+ * then forwards from the fixed entry of the oldest one. Entries only grow
+ * as blocks are added, so a streamed exit speed never becomes unsafe. */
+static void planner_recalculate(struct planner *p)
+{
+	struct block *b, *next;
+	double v = 0, a2 = 2 * p->cfg.accel;
+	int i;
+
+	for(i = p->count - 1; i >= 1; i--){
+		b = planner_block(p, i);
+		b->entry = fmin(b->max_entry, sqrt(v * v + a2 * b->length));
+		v = b->entry;
+	}
+	for(i = 0; i < p->count - 1; i++){
+		b = planner_block(p, i);
+		next = planner_block(p, i + 1);
+		v = sqrt(b->entry * b->entry + a2 * b->length);
+		if(next->entry > v)next->entry = v;
+	}
+}
+
+/* distance covered t seconds into a trapezoid */
+static double profile_distance(double t, double ve, double vc, double a, double t_acc, double t_cruise)
+{
+	double u;
+	if(t < t_acc)return ve * t + a * t * t / 2;
+	if(t < t_acc + t_cruise)return (ve + vc) / 2 * t_acc + vc * (t - t_acc);
+	u = t - t_acc - t_cruise;
+	return (ve + vc) / 2 * t_acc + vc * t_cruise + vc * u - a * u * u / 2;
+}
+
+/* cuts the oldest block into chunk_time long constant rate records
+ * following its trapezoid from the entry to the exit speed */
+static int planner_stream(struct planner *p, double exit)
+{
+	struct block *b = planner_block(p, 0);
+	double a = p->cfg.accel, ve = b->entry, vx = exit, vc = b->nominal;
+	double t_acc, t_dec, t_cruise, t_total, t, t_last = 0, s;
+	long done[PLANNER_AXES] = {0}, delta[PLANNER_AXES], target, major;
+	int i, err;
+
+	/* triangle when the cruise speed cannot be reached */
+	if((vc * vc - ve * ve) / (2 * a) + (vc * vc - vx * vx) / (2 * a) > b->length)
+		vc = sqrt((2 * a * b->length + ve * ve + vx * vx) / 2);
+	vc = fmax(vc, fmax(ve, vx));
+	t_acc = (vc - ve) / a;
+	t_dec = (vc - vx) / a;
+	t_cruise = (b->length - (ve + vc) / 2 * t_acc - (vc + vx) / 2 * t_dec) / vc;
+	if(t_cruise < 0)t_cruise = 0;
+	t_total = t_acc + t_cruise + t_dec;
+
+	for(t = 0; t < t_total;){
+		t = fmin(t + p->cfg.chunk_time, t_total);
+		s = t < t_total ? fmin(profile_distance(t, ve, vc, a, t_acc, t_cruise) / b->length, 1) : 1;
+		major = 0;
+		for(i = 0; i < PLANNER_AXES; i++){
+			target = lround(b->steps[i] * s);
+			delta[i] = target - done[i];
+			if(labs(delta[i]) > major)major = labs(delta[i]);
+		}
+		/* too slow for a step in this chunk, the next one carries it */
+		if(major == 0)continue;
+		err = planner_emit(p, delta, major, t - t_last);
+		if(err)return err;
+		for(i = 0; i < PLANNER_AXES; i++)done[i] += delta[i];
+		t_last = t;
+	}
+	p->head = (p->head + 1) % PLANNER_WINDOW;
+	p->count--;
+	/* the next block starts exactly at the speed this one ended */
+	if(p->count)planner_block(p, 0)->entry = exit;
+	return 0;
+}
+
+int planner_line(struct planner *p, const double target[PLANNER_AXES], double feed)
+{
+	struct block *b;
+	double d, sum = 0, rate, limit;
+	long steps;
+	int i, err;
+
+	if(p->count == PLANNER_WINDOW){
+		err = planner_stream(p, planner_block(p, 1)->entry);
+		if(err)return err;
+	}
+	b = planner_block(p, p->count);
+	memset(b, 0, sizeof(struct block));
+	rate = 0;
+	for(i = 0; i < PLANNER_AXES; i++){
+		steps = lround(target[i] * p->cfg.steps_per_mm[i]);
+		b->steps[i] = steps - p->steps[i];
+		d = target[i] - p->position[i];
+		b->unit[i] = d;
+		sum += d * d;
+		if(labs(b->steps[i]) > rate)rate = labs(b->steps[i]);
+	}
+	/* nothing to step, only the position is taken over */
+	b->length = sqrt(sum);
+	if(rate == 0 || b->length == 0){
+		memcpy(p->position, target, sizeof(p->position));
+		return 0;
+	}
+	for(i = 0; i < PLANNER_AXES; i++){
+		b->unit[i] /= b->length;
+		p->steps[i] += b->steps[i];
+		p->position[i] = target[i];
+	}
+	/* the busiest axis must stay under max_rate */
+	limit = p->cfg.max_rate * b->length / rate;
+	b->nominal = fmin(fmin(feed, p->cfg.max_feed), limit);
+	if(b->nominal <= 0)return -EINVAL;
+	if(p->count == 0)b->max_entry = 0;
+	else b->max_entry = junction_speed(&p->cfg, planner_block(p, p->count - 1), b);
+	b->entry = p->count == 0 ? 0 : b->max_entry;
+	p->count++;
+	planner_recalculate(p);
+	return 0;
+}
+
+void planner_get_position(struct planner *p, double pos[PLANNER_AXES])
+{
+	memcpy(pos, p->position, sizeof(p->position));
+}
+
+int planner_flush(struct planner *p)
+{
+	int err;
+	while(p->count){
+		err = planner_stream(p, p->count > 1 ? planner_block(p, 1)->entry : 0);
+		if(err)return err;
+	}
+	return planner_write(p);
+}
+
+void planner_close(struct planner *p)
+{
+	free(p);
+}
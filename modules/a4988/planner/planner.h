@@ -0,0 +1,38 @@
+#ifndef PLANNER_H
+#define PLANNER_H
+
+#include "a4988.h"
+
+#define PLANNER_AXES A4988_AXES_MAX
+/* blocks looked ahead, the oldest is streamed once the window is full */
+#define PLANNER_WINDOW 32
+
+struct planner_config {
+	double steps_per_mm[PLANNER_AXES];	/* steps of /dev/a4988_line, at the axis microstep mode */
+	double max_feed;	/* mm/s, also the G0 feed */
+	double accel;		/* mm/s^2 along the path */
+	double junction_deviation;	/* mm, how far a corner may be cut at speed */
+	double max_rate;	/* steps/s of the busiest axis, the driver takes up to 50000 */
+	double chunk_time;	/* s, length of one constant rate record */
+};
+
+struct planner;
+
+void planner_defaults(struct planner_config *cfg);
+
+/* fd is /dev/a4988_line, or anything that takes struct a4988_line records */
+struct planner *planner_open(const struct planner_config *cfg, int fd);
+
+/* queues a straight move to target (mm, absolute) at feed mm/s, planning
+ * it against the moves before it; may stream the oldest one, 0 or -errno */
+int planner_line(struct planner *p, const double target[PLANNER_AXES], double feed);
+
+/* mm, where the last queued move ends */
+void planner_get_position(struct planner *p, double pos[PLANNER_AXES]);
+
+/* streams everything queued, ending at standstill */
+int planner_flush(struct planner *p);
+
+void planner_close(struct planner *p);
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef AM335X_EHRPWM_H
+#define AM335X_EHRPWM_H
+
+#include <linux/io.h>
+#include <linux/types.h>
+
+/* AM335x ePWM output forced low from interrupt context, where the PWM
+ * core cannot be called. The channel still has to be requested, set up
+ * and enabled through the PWM core, pwm_enable() lifts the force again. */
+
+#define AM335X_EHRPWM_SIZE 0x60
+#define AM335X_EHRPWM_AQCSFRC 0x1c
+#define AM335X_EHRPWM_FRCLOW 1
+
+/* PWM core ids on the BeagleBone, 1 to 6 are ehrpwm0A, 0B, 1A, 1B, 2A
+ * and 2B; 0 and 7 are eCAP outputs */
+#define AM335X_EHRPWM_VALID(id) ((id) >= 1 && (id) <= 6)
+#define AM335X_EHRPWM_CHANNEL(id) (((id) - 1) & 1)
+
+static inline void __iomem *am335x_ehrpwm_map(int id)
+{
+	static const unsigned long base[3] = {
+		0x48300200, 0x48302200, 0x48304200,
+	};
+	return ioremap(base[(id - 1) >> 1], AM335X_EHRPWM_SIZE);
+}
+
+/* the PWM core leaves the software force shadowed, loaded when the
+ * counter wraps: the pulse under way finishes and the next one does not
+ * start, provided this runs within a period of its rising edge */
+static inline void am335x_ehrpwm_force_low(void __iomem *regs, int channel)
+{
+	int shift = channel * 2;
+	u16 v;
+
+	v = readw(regs + AM335X_EHRPWM_AQCSFRC);
+	writew((v & ~(3 << shift)) | (AM335X_EHRPWM_FRCLOW << shift), regs + AM335X_EHRPWM_AQCSFRC);
+}
+
+#endif
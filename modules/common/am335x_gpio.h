@@ -0,0 +1,80 @@
+#ifndef AM335X_GPIO_H
+#define AM335X_GPIO_H
+
+#include <linux/errno.h>
+#include <linux/io.h>
+#include <linux/irqflags.h>
+#include <linux/types.h>
+
+/* AM335x GPIO bank registers written directly, for pins toggled from
+ * timers and pins that have to change together. The pins still have to be
+ * requested and set to outputs through gpiolib first, only their output
+ * level is written here. */
+
+#define AM335X_GPIO_BANKS 4
+#define AM335X_GPIO_SIZE 0x1000
+#define AM335X_GPIO_DATAOUT 0x13c
+#define AM335X_GPIO_CLEARDATAOUT 0x190
+#define AM335X_GPIO_SETDATAOUT 0x194
+
+/* linux gpio numbers are bank * 32 + bit */
+#define AM335X_GPIO_BANK(gpio) ((gpio) >> 5)
+#define AM335X_GPIO_BIT(gpio) (1U << ((gpio) & 31))
+#define AM335X_GPIO_VALID(gpio) ((gpio) >= 0 && (gpio) < AM335X_GPIO_BANKS * 32)
+
+struct am335x_gpio {
+	void __iomem *bank[AM335X_GPIO_BANKS];
+};
+
+static inline void am335x_gpio_unmap(struct am335x_gpio *g)
+{
+	int i;
+	for(i = 0; i < AM335X_GPIO_BANKS; i++){
+		if(g->bank[i])iounmap(g->bank[i]);
+		g->bank[i] = NULL;
+	}
+}
+
+static inline int am335x_gpio_map(struct am335x_gpio *g)
+{
+	static const unsigned long base[AM335X_GPIO_BANKS] = {
+		0x44e07000, 0x4804c000, 0x481ac000, 0x481ae000,
+	};
+	int i;
+	for(i = 0; i < AM335X_GPIO_BANKS; i++){
+		g->bank[i] = ioremap(base[i], AM335X_GPIO_SIZE);
+		if(!g->bank[i]){
+			am335x_gpio_unmap(g);
+			return -ENOMEM;
+		}
+	}
+	return 0;
+}
+
+/* one pin, a single store which does not touch the rest of the bank */
+static inline void am335x_gpio_set(struct am335x_gpio *g, int gpio, int value)
+{
+	writel(AM335X_GPIO_BIT(gpio), g->bank[AM335X_GPIO_BANK(gpio)] +
+		(value ? AM335X_GPIO_SETDATAOUT : AM335X_GPIO_CLEARDATAOUT));
+}
+
+/* the pins of bank in mask take their levels from value at the same time;
+ * when some go up and some down DATAOUT is rewritten with interrupts off,
+ * which is atomic against gpiolib on the single core AM335x */
+static inline void am335x_gpio_write(struct am335x_gpio *g, int bank, u32 mask, u32 value)
+{
+	void __iomem *regs = g->bank[bank];
+	u32 set = value & mask, clear = ~value & mask, out;
+	unsigned long flags;
+
+	if(!clear)writel(set, regs + AM335X_GPIO_SETDATAOUT);
+	else if(!set)writel(clear, regs + AM335X_GPIO_CLEARDATAOUT);
+	else{
+		local_irq_save(flags);
+		out = readl(regs + AM335X_GPIO_DATAOUT);
+		writel((out & ~mask) | set, regs + AM335X_GPIO_DATAOUT);
+		local_irq_restore(flags);
+	}
+}
+
+#endif
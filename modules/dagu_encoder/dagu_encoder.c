@@ -1,76 +1,442 @@
 #include <linux/init.h>
 #include <linux/module.h>
+#include <linux/moduleparam.h>
 #include <linux/fs.h>
 #include <linux/device.h>
 #include <linux/gpio.h>
 #include <linux/interrupt.h>
-#include <asm/atomic.h>
+#include <linux/seqlock.h>
+#include <linux/cdev.h>
+#include <linux/hrtimer.h>
+#include <linux/uaccess.h>
+#include <linux/mm.h>
+#include <linux/sched.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+
+#include "dagu_encoder.h"
 
 #define DRVNAME			"DAGU ENCODER"
-#define PIN_A			66
-#define PIN_B			69
 #define SIGS_PER_ROT	192
 #define CIRCUMFERENCE	204204	/* in micrometers */
-#define DIST_PER_SIG	1064	/* in micrometers */
+#define DIST_PER_SIG	DAGU_ENCODER_DIST_PER_SIG
+#define DIST_PER_COUNT	(DIST_PER_SIG / 4)	/* quadrature, 4 counts per edge */
+
+/* the old defaults are the TB6612 AIN1/AIN2 lines, both drivers loaded
+ * together need the encoder moved to free pins */
+static int pin_a = 66, pin_b = 69;
+module_param(pin_a, int, S_IRUGO);
+MODULE_PARM_DESC(pin_a, "gpio of the channel A encoder");
+module_param(pin_b, int, S_IRUGO);
+MODULE_PARM_DESC(pin_b, "gpio of the channel B encoder");
+#define PIN_A			pin_a
+#define PIN_B			pin_b
+
+/* A and B as the two channels of one wheel instead of two wheels */
+static bool quadrature;
+module_param(quadrature, bool, S_IRUGO);
+MODULE_PARM_DESC(quadrature, "pins A and B are one quadrature encoder, counted on both edges");
+
+/* velocity from the times of the last VEL_HISTORY rising edges of a
+ * channel: as many periods as fit in VEL_WINDOW_NS, at least one, so a
+ * single period at low speed turns into a count over the window at high
+ * speed without a switch point */
+#define VEL_HISTORY	16
+#define VEL_WINDOW_NS	20000000
+static unsigned int standstill_ms = 500;
+module_param(standstill_ms, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(standstill_ms, "ms without an edge that read as zero velocity");
+
+/* noise: debounce in the GPIO block, and edges closer than min_interval_us
+ * to the last one taken on their channel dropped as glitches */
+static unsigned int debounce_us;
+module_param(debounce_us, uint, S_IRUGO);
+MODULE_PARM_DESC(debounce_us, "hardware debounce of both pins in us, 0 - off");
+static unsigned int min_interval_us;
+module_param(min_interval_us, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(min_interval_us, "edges closer than this to the last one of their channel are glitches, 0 - off");
+
+/* the hard interrupt only takes the time, the rest runs in its thread */
+static bool threaded;
+module_param(threaded, bool, S_IRUGO);
+MODULE_PARM_DESC(threaded, "count the edges in threaded interrupt handlers");
+static int irq_priority = MAX_RT_PRIO / 2;
+module_param(irq_priority, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(irq_priority, "SCHED_FIFO priority of the handler threads");
 
 static struct class *encoder_class;
-atomic_t sigs_a = ATOMIC_INIT(0);
-atomic_t sigs_b = ATOMIC_INIT(0);
-atomic_t rots_a = ATOMIC_INIT(0);
-atomic_t rots_b = ATOMIC_INIT(0);
+static struct dentry *encoder_debugfs;
+
+/* /dev/dagu_encoder hands out snapshots and maps the edge ring */
+static dev_t encoder_devt;
+static struct cdev encoder_cdev;
+static struct device *encoder_dev;
+
+/* every counter changes under counts_lock, the interrupts write and
+ * readers retry until they saw no write in between, so the two wheels
+ * are always read from the same instant */
+static DEFINE_SEQLOCK(counts_lock);
+static u64 edges[2];
+/* the rising edge n of a channel came at edge_times[][n % VEL_HISTORY] */
+static u64 edge_times[2][VEL_HISTORY];
+static u64 last_edge[2];	/* of the last edge taken, for the glitch filter */
+static u32 glitches[2];
+
+/* interrupt accounting for debugfs, irq_time hands the time of an edge
+ * to the handler thread */
+static int channel_id[2] = {0, 1};
+static atomic_t irqs[2] = {ATOMIC_INIT(0), ATOMIC_INIT(0)};
+static u64 irq_time[2];
+static DEFINE_MUTEX(stats_mutex);
+static unsigned int rate_irqs;	/* irqs and time at the last stats read */
+static u64 rate_time;
+/* written under counts_lock as well, so there is a single writer */
+static struct dagu_encoder_ring *ring;
+
+/* quadrature state machine, (A << 1) | B before and after a transition
+ * index the table; QUAD_ERR is both channels changing at once, an edge
+ * missed, which is counted and leaves the position alone */
+#define QUAD_ERR 2
+static const s8 quad_table[16] = {
+	0, -1, 1, QUAD_ERR,
+	1, 0, QUAD_ERR, -1,
+	-1, QUAD_ERR, 0, 1,
+	QUAD_ERR, 1, -1, 0,
+};
+static unsigned int quad_state;
+static s64 quad_count;
+static u32 quad_errors;
+static int quad_dir = 1;	/* of the last step, the sign of the velocity */
+
+/* um/s at now from the times of the last n edges, counts_lock not held */
+static s32 velocity(const u64 *times, u64 n, u64 now)
+{
+	u64 newest, dt, v;
+	unsigned int m;
+
+	if(n < 2)return 0;
+	newest = times[(n - 1) % VEL_HISTORY];
+	if(now - newest > (u64)standstill_ms * NSEC_PER_MSEC)return 0;
+	for(m = 1; m + 1 < VEL_HISTORY && m + 1 < n; m++)
+		if(newest - times[(n - 2 - m) % VEL_HISTORY] > VEL_WINDOW_NS)break;
+	dt = newest - times[(n - 1 - m) % VEL_HISTORY];
+	/* no edge for longer than the mean period, the wheel is at most
+	 * doing one edge in the time since the last one */
+	if((now - newest) * m > dt){
+		dt = now - newest;
+		m = 1;
+	}
+	if(dt == 0)return 0;
+	v = div64_u64((u64)m * DIST_PER_SIG * NSEC_PER_SEC, dt);
+	return min_t(u64, v, INT_MAX);
+}
+
+void dagu_encoder_snapshot(struct dagu_encoder_snapshot *snap)
+{
+	u64 times[2][VEL_HISTORY];
+	unsigned int seq;
+	int dir, ch;
+	memset(snap, 0, sizeof(*snap));
+	do{
+		seq = read_seqbegin(&counts_lock);
+		snap->edges[0] = edges[0];
+		snap->edges[1] = edges[1];
+		snap->count = quad_count;
+		snap->errors = quad_errors;
+		memcpy(times, edge_times, sizeof(times));
+		dir = quad_dir;
+		snap->timestamp = ktime_to_ns(ktime_get());
+	}while(read_seqretry(&counts_lock, seq));
+	for(ch = 0; ch < 2; ch++){
+		snap->velocity[ch] = velocity(times[ch], snap->edges[ch], snap->timestamp);
+		if(quadrature)snap->velocity[ch] *= dir;
+	}
+}
+EXPORT_SYMBOL_GPL(dagu_encoder_snapshot);
+
+unsigned long long dagu_encoder_edges(int channel)
+{
+	unsigned int seq;
+	u64 e;
+	do{
+		seq = read_seqbegin(&counts_lock);
+		e = edges[channel ? 1 : 0];
+	}while(read_seqretry(&counts_lock, seq));
+	return e;
+}
+EXPORT_SYMBOL_GPL(dagu_encoder_edges);
+
+long long dagu_encoder_count(void)
+{
+	unsigned int seq;
+	s64 c;
+	do{
+		seq = read_seqbegin(&counts_lock);
+		c = quad_count;
+	}while(read_seqretry(&counts_lock, seq));
+	return c;
+}
+EXPORT_SYMBOL_GPL(dagu_encoder_count);
 
 /* show and store functions declarations */
 static ssize_t distance_a_show(struct class *cls, struct class_attribute *attr, char *buf)
 {
-	unsigned long long distance;
-	distance = atomic_read(&rots_a) * CIRCUMFERENCE + atomic_read(&sigs_a) * DIST_PER_SIG;	/* distance micrometers */
-	return sprintf(buf, "%llu", distance);
+	return sprintf(buf, "%llu", dagu_encoder_edges(0) * DIST_PER_SIG);	/* distance micrometers */
 }
 
 static ssize_t distance_b_show(struct class *cls, struct class_attribute *attr, char *buf)
 {
-	unsigned long long distance;
-	distance = atomic_read(&rots_a) * CIRCUMFERENCE + atomic_read(&sigs_a) * DIST_PER_SIG;	/* distance in micrometers */
-	return sprintf(buf, "%llu", distance);
+	return sprintf(buf, "%llu", dagu_encoder_edges(1) * DIST_PER_SIG);	/* distance in micrometers */
+}
+
+static ssize_t velocity_a_show(struct class *cls, struct class_attribute *attr, char *buf)
+{
+	struct dagu_encoder_snapshot snap;
+	dagu_encoder_snapshot(&snap);
+	return sprintf(buf, "%i", snap.velocity[0]);	/* micrometers/s */
+}
+
+static ssize_t velocity_b_show(struct class *cls, struct class_attribute *attr, char *buf)
+{
+	struct dagu_encoder_snapshot snap;
+	dagu_encoder_snapshot(&snap);
+	return sprintf(buf, "%i", snap.velocity[1]);	/* micrometers/s */
+}
+
+/* quadrature, signed micrometers from the last reset */
+static ssize_t position_show(struct class *cls, struct class_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lld", dagu_encoder_count() * DIST_PER_COUNT);
+}
+
+static ssize_t errors_show(struct class *cls, struct class_attribute *attr, char *buf)
+{
+	struct dagu_encoder_snapshot snap;
+	dagu_encoder_snapshot(&snap);
+	return sprintf(buf, "%u", snap.errors);
 }
 
 static ssize_t reset_store(struct class *cls, struct class_attribute *attr, const char *buf, size_t count)
 {
-	atomic_set(&sigs_a, 0);
-	atomic_set(&sigs_b, 0);
-	atomic_set(&rots_a, 0);
-	atomic_set(&rots_b, 0);
+	unsigned long flags;
+	write_seqlock_irqsave(&counts_lock, flags);
+	edges[0] = 0;
+	edges[1] = 0;
+	quad_count = 0;
+	quad_dir = 1;
+	glitches[0] = 0;
+	glitches[1] = 0;
+	quad_errors = 0;
+	write_sequnlock_irqrestore(&counts_lock, flags);
 	return count;
 }
 
+static int encoder_open(struct inode *inode, struct file *file)
+{
+	return nonseekable_open(inode, file);
+}
+
+/* every read returns a single fresh snapshot, whatever room is left
+ * after it; a buffer too small for one is refused */
+static ssize_t encoder_read(struct file *file, char __user *buf, size_t count, loff_t *ppos)
+{
+	struct dagu_encoder_snapshot snap;
+
+	if(count < sizeof(snap))return -EINVAL;
+	dagu_encoder_snapshot(&snap);
+	return copy_to_user(buf, &snap, sizeof(snap)) ? -EFAULT : sizeof(snap);
+}
+
+static long encoder_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct dagu_encoder_snapshot snap;
+
+	if(cmd != DAGU_ENCODER_IOC_SNAPSHOT)return -ENOTTY;
+	dagu_encoder_snapshot(&snap);
+	return copy_to_user((void __user *)arg, &snap, sizeof(snap)) ? -EFAULT : 0;
+}
+
+static int encoder_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	if(vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start > DAGU_ENCODER_RING_SIZE)return -EINVAL;
+	if(vma->vm_flags & VM_WRITE)return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
+	return remap_pfn_range(vma, vma->vm_start, virt_to_phys(ring) >> PAGE_SHIFT, vma->vm_end - vma->vm_start, vma->vm_page_prot);
+}
+
+static const struct file_operations encoder_fops = {
+	.owner = THIS_MODULE,
+	.open = encoder_open,
+	.read = encoder_read,
+	.unlocked_ioctl = encoder_ioctl,
+	.mmap = encoder_mmap,
+	.llseek = no_llseek,
+};
+
 /* attributes */
 static struct class_attribute distance_a_attr = __ATTR(distance_a, 0660, distance_a_show, NULL);
 static struct class_attribute distance_b_attr = __ATTR(distance_b, 0660, distance_b_show, NULL);
+static struct class_attribute velocity_a_attr = __ATTR(velocity_a, 0660, velocity_a_show, NULL);
+static struct class_attribute velocity_b_attr = __ATTR(velocity_b, 0660, velocity_b_show, NULL);
+static struct class_attribute position_attr = __ATTR(position, 0660, position_show, NULL);
+static struct class_attribute errors_attr = __ATTR(errors, 0660, errors_show, NULL);
 static struct class_attribute reset_attr = __ATTR(reset, 0660, NULL, reset_store);
 
-/* interrupt service routines */
-static irq_handler_t pin_a_irq(unsigned int irq, void *dev_id, struct pt_regs *regs)
+/* interrupt service routines, counts_lock held for ring_log() */
+static void ring_log(u64 timestamp, u32 channel, u32 level)
+{
+	struct dagu_encoder_edge *e = &ring->edge[ring->head % DAGU_ENCODER_RING_LEN];
+	e->timestamp = timestamp;
+	e->channel = channel;
+	e->level = level;
+	smp_wmb();
+	ACCESS_ONCE(ring->head) = ring->head + 1;
+}
+
+/* a rising edge of channel ch */
+static void edge_count(int ch, u64 now)
+{
+	edge_times[ch][edges[ch] % VEL_HISTORY] = now;
+	edges[ch]++;
+}
+
+/* quadrature, both edges of both pins; the rising edges still count into
+ * distance_a and distance_b for dagu_encoder_edges() users */
+static void quad_edge(u64 now)
+{
+	unsigned int state;
+	s8 step;
+
+	state = (gpio_get_value(PIN_A) ? 2 : 0) | (gpio_get_value(PIN_B) ? 1 : 0);
+	step = quad_table[(quad_state << 2) | state];
+	if(step == QUAD_ERR)quad_errors++;
+	else if(step){
+		quad_count += step;
+		quad_dir = step;
+	}
+	if((state & ~quad_state) & 2)edge_count(0, now);
+	if((state & ~quad_state) & 1)edge_count(1, now);
+	if((state ^ quad_state) & 2)ring_log(now, 0, state >> 1);
+	if((state ^ quad_state) & 1)ring_log(now, 1, state & 1);
+	quad_state = state;
+}
+
+/* the bookkeeping of an edge of channel ch, in the hard interrupt or in
+ * its thread; interrupts stay off in the write section either way, a
+ * reader in interrupt context would spin on it for good otherwise */
+static void edge_account(int ch, u64 now)
 {
-	atomic_inc(&sigs_a);
-	if(atomic_read(&sigs_a) == SIGS_PER_ROT){
-		atomic_inc(&rots_a);
-		atomic_set(&sigs_a, 0);
+	unsigned long flags;
+
+	write_seqlock_irqsave(&counts_lock, flags);
+	if(min_interval_us && now - last_edge[ch] < (u64)min_interval_us * NSEC_PER_USEC){
+		glitches[ch]++;
+		write_sequnlock_irqrestore(&counts_lock, flags);
+		return;
 	}
-	return (irq_handler_t)IRQ_HANDLED;
+	last_edge[ch] = now;
+	if(quadrature)quad_edge(now);
+	else{
+		edge_count(ch, now);
+		ring_log(now, ch, 1);
+	}
+	write_sequnlock_irqrestore(&counts_lock, flags);
 }
 
-static irq_handler_t pin_b_irq(unsigned int irq, void *dev_id, struct pt_regs *regs)
+static irqreturn_t edge_irq(int irq, void *dev_id)
 {
-	atomic_inc(&sigs_b);
-	if(atomic_read(&sigs_b) == SIGS_PER_ROT){
-		atomic_inc(&rots_b);
-		atomic_set(&sigs_b, 0);
+	int ch = *(int *)dev_id;
+	u64 now = ktime_to_ns(ktime_get());
+
+	atomic_inc(&irqs[ch]);
+	if(threaded){
+		irq_time[ch] = now;
+		return IRQ_WAKE_THREAD;
 	}
-	return (irq_handler_t)IRQ_HANDLED;
+	edge_account(ch, now);
+	return IRQ_HANDLED;
+}
+
+/* IRQF_ONESHOT keeps the line masked until this returns, so irq_time is
+ * not overwritten meanwhile; in quadrature the pins are read here, later
+ * than the edge */
+static irqreturn_t edge_thread(int irq, void *dev_id)
+{
+	struct sched_param param = { .sched_priority = clamp(irq_priority, 1, MAX_RT_PRIO - 1) };
+	int ch = *(int *)dev_id;
+
+	if(current->rt_priority != param.sched_priority)sched_setscheduler(current, SCHED_FIFO, &param);
+	edge_account(ch, irq_time[ch]);
+	return IRQ_HANDLED;
+}
+
+/* debugfs dagu_encoder/stats, the rate is over the time since the last
+ * read; any write clears it all */
+static int stats_show(struct seq_file *m, void *v)
+{
+	struct dagu_encoder_snapshot snap;
+	unsigned int seq, total, rate = 0;
+	u32 g[2];
+	u64 now;
+
+	do{
+		seq = read_seqbegin(&counts_lock);
+		g[0] = glitches[0];
+		g[1] = glitches[1];
+	}while(read_seqretry(&counts_lock, seq));
+	dagu_encoder_snapshot(&snap);
+
+	mutex_lock(&stats_mutex);
+	now = ktime_to_ns(ktime_get());
+	total = atomic_read(&irqs[0]) + atomic_read(&irqs[1]);
+	if(now > rate_time)rate = div64_u64((u64)(total - rate_irqs) * NSEC_PER_SEC, now - rate_time);
+	rate_irqs = total;
+	rate_time = now;
+	mutex_unlock(&stats_mutex);
+
+	seq_printf(m, "irqs: %u %u\nirq rate: %u/s\nglitches: %u %u\n",
+		atomic_read(&irqs[0]), atomic_read(&irqs[1]), rate, g[0], g[1]);
+	if(quadrature)seq_printf(m, "quadrature errors: %u\n", snap.errors);
+	seq_printf(m, "handler: %s\n", threaded ? "threaded" : "hard");
+	return 0;
+}
+
+static int stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, stats_show, inode->i_private);
+}
+
+static ssize_t stats_write(struct file *file, const char __user *buf, size_t lbuf, loff_t *ppos)
+{
+	unsigned long flags;
+	write_seqlock_irqsave(&counts_lock, flags);
+	glitches[0] = 0;
+	glitches[1] = 0;
+	write_sequnlock_irqrestore(&counts_lock, flags);
+	mutex_lock(&stats_mutex);
+	atomic_set(&irqs[0], 0);
+	atomic_set(&irqs[1], 0);
+	rate_irqs = 0;
+	rate_time = ktime_to_ns(ktime_get());
+	mutex_unlock(&stats_mutex);
+	return lbuf;
 }
 
+static const struct file_operations stats_fops = {
+	.owner = THIS_MODULE,
+	.open = stats_open,
+	.read = seq_read,
+	.write = stats_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
 static int __init encoder_init(void)
 {
+	unsigned long flags = quadrature ? IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING : IRQF_TRIGGER_RISING;
+
+	if(threaded)flags |= IRQF_ONESHOT;
+
 	/* create entries in sysfs */
 	encoder_class = class_create(THIS_MODULE, "dagu");
 	if(encoder_class == NULL){
@@ -92,41 +458,109 @@ static int __init encoder_init(void)
 		printk(KERN_ERR "%s: Cannot create sysfs attribute\n", DRVNAME);
 		goto err3;
 	}
+
+	if(class_create_file(encoder_class, &position_attr) != 0){
+		printk(KERN_ERR "%s: Cannot create sysfs attribute\n", DRVNAME);
+		goto err4;
+	}
+
+	if(class_create_file(encoder_class, &errors_attr) != 0){
+		printk(KERN_ERR "%s: Cannot create sysfs attribute\n", DRVNAME);
+		goto err5;
+	}
+
+	if(class_create_file(encoder_class, &velocity_a_attr) != 0){
+		printk(KERN_ERR "%s: Cannot create sysfs attribute\n", DRVNAME);
+		goto err6;
+	}
+
+	if(class_create_file(encoder_class, &velocity_b_attr) != 0){
+		printk(KERN_ERR "%s: Cannot create sysfs attribute\n", DRVNAME);
+		goto err7;
+	}
 	
+	ring = (struct dagu_encoder_ring *)__get_free_pages(GFP_KERNEL | __GFP_ZERO, get_order(DAGU_ENCODER_RING_SIZE));
+	if(ring == NULL){
+		printk(KERN_ERR "%s: Cannot allocate the edge ring\n", DRVNAME);
+		goto err8;
+	}
+
 	/* gpio initialization */
 	if(gpio_request(PIN_A, "pin_a") != 0){
 		printk(KERN_ERR "%s: Cannot request gpio\n", DRVNAME);
-		goto err4;
+		goto err9;
 	}
 	gpio_direction_input(PIN_A);
 	gpio_export(PIN_A, false);
 	
 	if(gpio_request(PIN_B, "pin_b") != 0){
 		printk(KERN_ERR "%s: Cannot request gpio\n", DRVNAME);
-		goto err5;
+		goto err10;
 	}
 	gpio_direction_input(PIN_B);
 	gpio_export(PIN_B, false);
+	if(debounce_us && (gpio_set_debounce(PIN_A, debounce_us) != 0 || gpio_set_debounce(PIN_B, debounce_us) != 0))
+		printk(KERN_WARNING "%s: No hardware debounce on these pins\n", DRVNAME);
+	quad_state = (gpio_get_value(PIN_A) ? 2 : 0) | (gpio_get_value(PIN_B) ? 1 : 0);
 	
-	if(request_irq(gpio_to_irq(PIN_A), (irq_handler_t)pin_a_irq, IRQF_TRIGGER_RISING, "pin_a_irq", NULL) != 0){
+	if(request_threaded_irq(gpio_to_irq(PIN_A), edge_irq, threaded ? edge_thread : NULL, flags, "pin_a_irq", &channel_id[0]) != 0){
 		printk(KERN_ERR "%s: Cannot request interrupt\n", DRVNAME);
-		goto err6;
+		goto err11;
 	}
-	if(request_irq(gpio_to_irq(PIN_B), (irq_handler_t)pin_b_irq, IRQF_TRIGGER_RISING, "pin_b_irq", NULL) != 0){
+	if(request_threaded_irq(gpio_to_irq(PIN_B), edge_irq, threaded ? edge_thread : NULL, flags, "pin_b_irq", &channel_id[1]) != 0){
 		printk(KERN_ERR "%s: Cannot request interrupt\n", DRVNAME);
-		goto err7;
+		goto err12;
+	}
+
+	/* /dev/dagu_encoder, snapshots of both wheels */
+	if(alloc_chrdev_region(&encoder_devt, 0, 1, "dagu_encoder") < 0){
+		printk(KERN_ERR "%s: alloc_chrdev_region failed\n", DRVNAME);
+		goto err13;
+	}
+	cdev_init(&encoder_cdev, &encoder_fops);
+	if(cdev_add(&encoder_cdev, encoder_devt, 1) != 0){
+		printk(KERN_ERR "%s: cdev_add failed\n", DRVNAME);
+		goto err14;
 	}
+	encoder_dev = device_create(encoder_class, NULL, encoder_devt, NULL, "dagu_encoder");
+	if(IS_ERR(encoder_dev)){
+		printk(KERN_ERR "%s: Cannot create device\n", DRVNAME);
+		goto err15;
+	}
+
+	/* interrupt load, it works without as well */
+	rate_time = ktime_to_ns(ktime_get());
+	encoder_debugfs = debugfs_create_dir("dagu_encoder", NULL);
+	if(IS_ERR_OR_NULL(encoder_debugfs))encoder_debugfs = NULL;
+	else debugfs_create_file("stats", 0600, encoder_debugfs, NULL, &stats_fops);
 	
-	printk(KERN_INFO "%s: Module loaded\n", DRVNAME);
+	printk(KERN_INFO "%s: Module loaded%s\n", DRVNAME, quadrature ? ", quadrature" : "");
 	return 0;
 	
-	err7:
-	free_irq(gpio_to_irq(PIN_A), NULL);
-	err6:
+	err15:
+	cdev_del(&encoder_cdev);
+	err14:
+	unregister_chrdev_region(encoder_devt, 1);
+	err13:
+	free_irq(gpio_to_irq(PIN_B), &channel_id[1]);
+	err12:
+	free_irq(gpio_to_irq(PIN_A), &channel_id[0]);
+	err11:
 	gpio_unexport(PIN_B);
-	err5:
+	gpio_free(PIN_B);
+	err10:
 	gpio_unexport(PIN_A);
 	gpio_free(PIN_A);
+	err9:
+	free_pages((unsigned long)ring, get_order(DAGU_ENCODER_RING_SIZE));
+	err8:
+	class_remove_file(encoder_class, &velocity_b_attr);
+	err7:
+	class_remove_file(encoder_class, &velocity_a_attr);
+	err6:
+	class_remove_file(encoder_class, &errors_attr);
+	err5:
+	class_remove_file(encoder_class, &position_attr);
 	err4:
 	class_remove_file(encoder_class, &reset_attr);
 	err3:
@@ -140,12 +574,21 @@ static int __init encoder_init(void)
 
 static void __exit encoder_exit(void)
 {
-	free_irq(gpio_to_irq(PIN_B), NULL);
-	free_irq(gpio_to_irq(PIN_A), NULL);
+	if(encoder_debugfs)debugfs_remove_recursive(encoder_debugfs);
+	device_destroy(encoder_class, encoder_devt);
+	cdev_del(&encoder_cdev);
+	unregister_chrdev_region(encoder_devt, 1);
+	free_irq(gpio_to_irq(PIN_B), &channel_id[1]);
+	free_irq(gpio_to_irq(PIN_A), &channel_id[0]);
 	gpio_unexport(PIN_B);
 	gpio_free(PIN_B);
 	gpio_unexport(PIN_A);
 	gpio_free(PIN_A);
+	free_pages((unsigned long)ring, get_order(DAGU_ENCODER_RING_SIZE));
+	class_remove_file(encoder_class, &velocity_b_attr);
+	class_remove_file(encoder_class, &velocity_a_attr);
+	class_remove_file(encoder_class, &errors_attr);
+	class_remove_file(encoder_class, &position_attr);
 	class_remove_file(encoder_class, &reset_attr);
 	class_remove_file(encoder_class, &distance_b_attr);
 	class_remove_file(encoder_class, &distance_a_attr);
@@ -0,0 +1,84 @@
+#ifndef DAGU_ENCODER_H
+#define DAGU_ENCODER_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define DAGU_ENCODER_DIST_PER_SIG	1064	/* micrometers of travel per edge */
+
+/* both wheels at one instant, from read() or DAGU_ENCODER_IOC_SNAPSHOT on
+ * /dev/dagu_encoder */
+struct dagu_encoder_snapshot {
+	__u64 edges[2];	/* rising edges of channel A and B since the last reset */
+	__s64 count;	/* quadrature=1, signed, 4 per edge of one channel */
+	__u32 errors;	/* quadrature=1, illegal transitions */
+	__u32 reserved;
+	__u64 timestamp;	/* CLOCK_MONOTONIC ns the counts were taken at */
+	__s32 velocity[2];	/* um/s of channel A and B at timestamp, signed with quadrature=1 */
+	__u32 reserved2[2];
+};
+
+/* every edge as it came, in the ring mmap()ed read only from
+ * /dev/dagu_encoder, offset 0 and DAGU_ENCODER_RING_SIZE long */
+struct dagu_encoder_edge {
+	__u64 timestamp;	/* CLOCK_MONOTONIC ns, taken in the interrupt */
+	__u32 channel;	/* 0 - A, 1 - B */
+	__u32 level;	/* of the pin after the edge, always 1 without quadrature */
+};
+
+#define DAGU_ENCODER_RING_LEN 2048
+
+/* the driver writes the entry, then head with a barrier between; head
+ * only grows and wraps at 2^32, entry n is at edge[n % RING_LEN] until
+ * head passes n + RING_LEN. Readers keep their own tail, see
+ * dagu_encoder_ring_read(). */
+struct dagu_encoder_ring {
+	__u32 head;
+	__u32 reserved[15];
+	struct dagu_encoder_edge edge[DAGU_ENCODER_RING_LEN];
+};
+
+#define DAGU_ENCODER_RING_SIZE ((sizeof(struct dagu_encoder_ring) + 4095) & ~4095)
+
+#ifndef __KERNEL__
+/* up to n edges from *tail on into out, moving *tail past them. Returns
+ * how many, or -1 when the driver overwrote some before they were read;
+ * *tail then points at the oldest edge still in the ring. The driver
+ * fills slot head before moving head on, so a reader a whole ring behind
+ * may already be looking at the next edge being written. */
+static inline int dagu_encoder_ring_read(const volatile struct dagu_encoder_ring *r, __u32 *tail, struct dagu_encoder_edge *out, int n)
+{
+	__u32 head = r->head, t = *tail;
+	int i;
+
+	__sync_synchronize();
+	for(i = 0; i < n && t != head; i++, t++)out[i] = r->edge[t % DAGU_ENCODER_RING_LEN];
+	__sync_synchronize();
+	head = r->head;
+	if(head - *tail >= DAGU_ENCODER_RING_LEN){
+		*tail = head - DAGU_ENCODER_RING_LEN + 1;
+		return -1;
+	}
+	*tail = t;
+	return i;
+}
+#endif
+
+#define DAGU_ENCODER_IOC_MAGIC 'd'
+#define DAGU_ENCODER_IOC_SNAPSHOT _IOR(DAGU_ENCODER_IOC_MAGIC, 1, struct dagu_encoder_snapshot)
+
+#ifdef __KERNEL__
+/* rising edges counted on channel 0 (A) or 1 (B) since the last reset;
+ * callable from interrupt context, other modules take it with symbol_get()
+ * so they load without the encoder */
+unsigned long long dagu_encoder_edges(int channel);
+
+/* with quadrature=1, the signed count of A and B transitions, four per
+ * edge of one channel, positive with A leading B */
+long long dagu_encoder_count(void);
+
+/* everything in one consistent read, callable from interrupt context */
+void dagu_encoder_snapshot(struct dagu_encoder_snapshot *snap);
+#endif
+
+#endif
@@ -2,75 +2,1051 @@
 #include <linux/module.h>
 #include <linux/device.h>
 #include <linux/pwm.h>
+#include <linux/mutex.h>
+#include <linux/math64.h>
+#include <linux/fs.h>
+#include <linux/cdev.h>
+#include <linux/mm.h>
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/hrtimer.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+#include <linux/of.h>
+#include <linux/platform_device.h>
+#include <linux/firmware.h>
+#include <linux/io.h>
+
+#include "servo.h"
 
 #define DRVNAME "SERVO"
 
-#define ANGLE_PWM	4 /* P9_16 */
+/* defaults for a channel node without calibration */
 #define PWM_PERIOD	20000000
 #define MAX_DUTY	2500000
 #define MIN_DUTY	500000
-/* it isn't joke
- * pwm = MIN_DUTY + (MAX_DUTY - MIN_DUTY) * (angle / 180)
- * pwm = MIN_DUTY + ((MAX_DUTY - MIN_DUTY) / 180) * angle
- * MAX_DUTY - MIN_DUTY) / 180- this is constant
- * (2500000 - 500000) / 180 = 2000000 / 180 = 11111,(1) what was rounded to 11111 */
-#define ANGLE_CONST	11111
-
-static unsigned int angle = 0;
-static unsigned int angle_duty = MIN_DUTY;
+#define RANGE_MDEG	180000
+#define PERIOD_MAX	100000000
+
+/* PRU-ICSS, pru/servo firmware; addresses for pru0, pru1 at PRU_*_OFFSET */
+#define PRUSS_BASE 0x4a300000
+#define PRU_DRAM 0x00000
+#define PRU_SHARED 0x10000
+#define PRU_CTRL 0x22000
+#define PRU_IRAM 0x34000
+#define PRU_DRAM_OFFSET 0x2000
+#define PRU_CTRL_OFFSET 0x2000
+#define PRU_IRAM_OFFSET 0x4000
+#define PRU_RAM_SIZE 0x2000
+#define PRU_CTRL_RESET 0
+#define PRU_CTRL_DISABLE 1
+#define PRU_CTRL_ENABLE 2
+#define PRU_FIRMWARE "servo-pru.bin"
+/* pulse table in shared RAM, the firmware keeps its last good copy at the
+ * start of its data RAM */
+#define PRU_TABLE_SEQ 0x00
+#define PRU_TABLE_ENABLE 0x04
+#define PRU_TABLE_PERIOD 0x08
+#define PRU_TABLE_WIDTH 0x10
+#define PRU_TABLE_SIZE 0x50
+#define PRU_CHANNELS 16
+#define PRU_NS_PER_TICK 1000
+
+/* trajectory position and time, fractions of the move in Q16 */
+#define TRAJ_ONE	(1 << 16)
+
+enum { PROFILE_MINJERK, PROFILE_TRAPEZOID };
+static const char * const profile_names[] = {"minjerk", "trapezoid"};
+/* peak over mean velocity, per mille, sets how long a velocity limited
+ * move must take */
+static const unsigned int profile_peak[] = {1875, 1333};
+
+/* one channel, a devicetree node. The pulse width goes from min_pulse at
+ * 0 to max_pulse at range millidegrees, worked out in 64 bits so no step
+ * is lost to rounding. */
+struct servo {
+	int id;
+	int pwm_id;
+	struct pwm_device *pwm;
+	int pru, pru_channel;	/* PRU core and r30 bit instead of pwm_id, -1 */
+	struct device *dev;
+	unsigned int min_pulse, max_pulse;	/* ns */
+	unsigned int range;	/* millidegrees */
+	unsigned int angle;	/* millidegrees */
+	unsigned int duty, period;	/* ns */
+	/* duty and period last given to the PWM, equal writes are skipped */
+	unsigned int applied_duty, applied_period;
+	/* a move from one angle to another over duration ns from start,
+	 * stepped by servo_task once per period */
+	int profile;
+	unsigned int velocity;	/* millidegrees/s, 0 for no limit */
+	int moving;
+	unsigned int from, to;	/* millidegrees */
+	s64 start;
+	u64 duration;
+};
+
+/* servo_mutex guards the channel table and every channel */
+static struct servo *servos[SERVO_CHANNELS_MAX];
+static DEFINE_MUTEX(servo_mutex);
 static struct class *servo_class;
-static struct pwm_device *angle_pwm;
+/* channels with a move under way, servo_task runs while there are any */
+static int servo_moving;
+
+/* one PRU runs every PRU channel, started with the first of them; they
+ * share its frame period. servo_mutex guards all of it. */
+static int pru_core = -1;
+static u32 pru_used;	/* r30 bits of the probed channels */
+static u32 pru_seq;
+static unsigned int pru_period;	/* ns */
+static void __iomem *pru_ram;
+static void __iomem *pru_ctrl;
+static void __iomem *pru_table;
+
+/* /dev/servo takes group writes, its setpoint page is read by servo_task
+ * once per period while mapped */
+static dev_t servo_devt;
+static struct cdev servo_cdev;
+static struct device *servo_dev;
+static struct servo_setpoints *setpoints;
+static atomic_t setpoints_maps = ATOMIC_INIT(0);
+static u32 setpoints_seq;
+static struct task_struct *servo_task;
+
+/* PRU backend
+ * the widths are plain writes to the table, a group goes between
+ * pru_begin() and pru_end() so the firmware takes it in one frame */
+static void pru_begin(void)
+{
+	if(!pru_used)return;
+	writel(++pru_seq, pru_table + PRU_TABLE_SEQ);
+	wmb();
+}
+
+static void pru_end(void)
+{
+	if(!pru_used)return;
+	wmb();
+	writel(++pru_seq, pru_table + PRU_TABLE_SEQ);
+}
+
+static void pru_width(struct servo *s, unsigned int duty)
+{
+	writel(DIV_ROUND_CLOSEST(duty, PRU_NS_PER_TICK), pru_table + PRU_TABLE_WIDTH + 4 * s->pru_channel);
+}
+
+/* loads the firmware into the selected PRU with an empty table */
+static int pru_start(int core, struct device *dev)
+{
+	const struct firmware *fw;
+	void __iomem *iram;
+	int err;
+
+	pru_ram = ioremap(PRUSS_BASE + PRU_DRAM + core * PRU_DRAM_OFFSET, PRU_RAM_SIZE);
+	pru_ctrl = ioremap(PRUSS_BASE + PRU_CTRL + core * PRU_CTRL_OFFSET, 4);
+	pru_table = ioremap(PRUSS_BASE + PRU_SHARED, PRU_TABLE_SIZE);
+	iram = ioremap(PRUSS_BASE + PRU_IRAM + core * PRU_IRAM_OFFSET, PRU_RAM_SIZE);
+	if(!pru_ram || !pru_ctrl || !pru_table || !iram){
+		printk(KERN_ERR "%s: Cannot map PRU%i memory\n", DRVNAME, core);
+		err = -ENOMEM;
+		goto err1;
+	}
+	err = request_firmware(&fw, PRU_FIRMWARE, dev);
+	if(err){
+		printk(KERN_ERR "%s: Cannot load %s(%i)\n", DRVNAME, PRU_FIRMWARE, err);
+		goto err1;
+	}
+	if(fw->size > PRU_RAM_SIZE){
+		printk(KERN_ERR "%s: %s does not fit in PRU memory\n", DRVNAME, PRU_FIRMWARE);
+		err = -EINVAL;
+		goto err2;
+	}
+	writel(PRU_CTRL_RESET, pru_ctrl);
+	memset_io(pru_ram, 0, PRU_TABLE_SIZE);
+	memset_io(pru_table, 0, PRU_TABLE_SIZE);
+	pru_seq = 0;
+	memcpy_toio(iram, fw->data, fw->size);
+	writel(PRU_CTRL_ENABLE, pru_ctrl);
+	release_firmware(fw);
+	iounmap(iram);
+	pru_core = core;
+	return 0;
+
+	err2:
+	release_firmware(fw);
+	err1:
+	if(iram)iounmap(iram);
+	if(pru_table)iounmap(pru_table);
+	if(pru_ctrl)iounmap(pru_ctrl);
+	if(pru_ram)iounmap(pru_ram);
+	return err;
+}
+
+static void pru_stop(void)
+{
+	writel(PRU_CTRL_DISABLE, pru_ctrl);
+	iounmap(pru_table);
+	iounmap(pru_ctrl);
+	iounmap(pru_ram);
+	pru_core = -1;
+}
+
+/* a channel joins the running frame, the first one starts the PRU with
+ * its own period */
+static int pru_attach(struct servo *s, struct device *dev)
+{
+	int err;
+
+	if(pru_used && s->pru != pru_core){
+		printk(KERN_ERR "%s: PRU%i already runs the PRU channels\n", DRVNAME, pru_core);
+		return -EBUSY;
+	}
+	if(pru_used & (1U << s->pru_channel)){
+		printk(KERN_ERR "%s: PRU channel %i used twice\n", DRVNAME, s->pru_channel);
+		return -EBUSY;
+	}
+	if(pru_used && s->max_pulse > pru_period){
+		printk(KERN_ERR "%s: max pulse over the PRU period %u\n", DRVNAME, pru_period);
+		return -EINVAL;
+	}
+	if(!pru_used){
+		err = pru_start(s->pru, dev);
+		if(err)return err;
+		pru_period = s->period;
+		writel(pru_period / PRU_NS_PER_TICK, pru_table + PRU_TABLE_PERIOD);
+	}
+	s->period = pru_period;
+	pru_width(s, s->duty);
+	pru_used |= 1U << s->pru_channel;
+	writel(pru_used, pru_table + PRU_TABLE_ENABLE);
+	return 0;
+}
+
+static void pru_detach(struct servo *s)
+{
+	pru_used &= ~(1U << s->pru_channel);
+	writel(pru_used, pru_table + PRU_TABLE_ENABLE);
+	pru_width(s, 0);
+	if(!pru_used)pru_stop();
+}
+
+/* the frame of every PRU channel, none may end up with a pulse longer */
+static int pru_period_set(unsigned int period)
+{
+	struct servo *s;
+	int i;
+
+	for(i = 0; i < SERVO_CHANNELS_MAX; i++){
+		s = servos[i];
+		if(s && s->pru >= 0 && (period < s->max_pulse || period < s->duty))return -EINVAL;
+	}
+	writel(period / PRU_NS_PER_TICK, pru_table + PRU_TABLE_PERIOD);
+	pru_period = period;
+	for(i = 0; i < SERVO_CHANNELS_MAX; i++){
+		s = servos[i];
+		if(!s || s->pru < 0)continue;
+		s->period = period;
+		s->applied_period = period;
+	}
+	return 0;
+}
+
+static int servo_apply(struct servo *s, unsigned int duty, unsigned int period)
+{
+	int err = 0;
+	if(duty == s->applied_duty && period == s->applied_period)return 0;
+	if(s->pru >= 0)pru_width(s, duty);
+	else err = pwm_config(s->pwm, duty, period);
+	if(err)return err;
+	s->applied_duty = duty;
+	s->applied_period = period;
+	return 0;
+}
+
+static unsigned int angle_duty(struct servo *s, unsigned int mdeg)
+{
+	return s->min_pulse + div_u64((u64)(s->max_pulse - s->min_pulse) * mdeg + s->range / 2, s->range);
+}
+
+/* how much of the move is done at time tau, both Q16 */
+static u32 profile_pos(int profile, u32 tau)
+{
+	u64 t2, t3;
 
-/* show and store functions declarations */
-static ssize_t angle_show(struct class *cls, struct class_attribute *attr, char *buf);
-static ssize_t angle_store(struct class *cls, struct class_attribute *attr, const char *buf, size_t count);
+	if(profile == PROFILE_TRAPEZOID){
+		/* a quarter of the time speeding up, half at 4/3 of the mean
+		 * velocity, a quarter slowing down */
+		if(tau < TRAJ_ONE / 4)return div_u64(8ULL * tau * tau, 3 * TRAJ_ONE);
+		if(tau > TRAJ_ONE / 4 * 3){
+			tau = TRAJ_ONE - tau;
+			return TRAJ_ONE - div_u64(8ULL * tau * tau, 3 * TRAJ_ONE);
+		}
+		return TRAJ_ONE / 6 + div_u64(4ULL * (tau - TRAJ_ONE / 4), 3);
+	}
+	/* minimum jerk, 10t^3 - 15t^4 + 6t^5 */
+	t2 = ((u64)tau * tau) >> 16;
+	t3 = (t2 * tau) >> 16;
+	return (t3 * (10ULL * TRAJ_ONE + 6 * t2 - 15ULL * tau)) >> 16;
+}
+
+/* servo_mutex held for both, moving is pollable */
+static void servo_start(struct servo *s)
+{
+	if(s->moving)return;
+	s->moving = 1;
+	servo_moving++;
+	sysfs_notify(&s->dev->kobj, NULL, "moving");
+}
+
+static void servo_stop(struct servo *s)
+{
+	if(!s->moving)return;
+	s->moving = 0;
+	servo_moving--;
+	sysfs_notify(&s->dev->kobj, NULL, "moving");
+}
+
+/* the channels in mask to the duty worked out for them, servo_mutex held.
+ * The pwm_config() calls go back to back: the two channels of one ehrpwm
+ * load their new duty at the same period start, channels on different PWM
+ * modules within one period of each other. PRU channels all take theirs
+ * in the same frame. */
+static int servo_group_apply(u32 mask, const u32 *mdeg, const unsigned int *duty)
+{
+	struct servo *s;
+	int i, err = 0;
+
+	pru_begin();
+	for(i = 0; i < SERVO_CHANNELS_MAX; i++){
+		if(!(mask & (1U << i)))continue;
+		s = servos[i];
+		if(servo_apply(s, duty[i], s->period) != 0){
+			err = -EIO;
+			continue;
+		}
+		s->angle = mdeg[i];
+		s->duty = duty[i];
+	}
+	pru_end();
+	return err;
+}
+
+/* the channels in mask to their angles in duration ms, servo_mutex held.
+ * Everything is checked before anything moves. Without a duration the
+ * move takes as long as the slowest channel needs at its velocity limit,
+ * with no limit anywhere the outputs jump at once. A move under way is
+ * taken over from where it is. */
+static int servo_group_set(u32 mask, const u32 *mdeg, unsigned int duration)
+{
+	unsigned int duty[SERVO_CHANNELS_MAX];
+	struct servo *s;
+	u64 t, longest = (u64)duration * NSEC_PER_MSEC;
+	s64 now;
+	int i;
+
+	if(mask >> SERVO_CHANNELS_MAX)return -ENODEV;
+	for(i = 0; i < SERVO_CHANNELS_MAX; i++){
+		if(!(mask & (1U << i)))continue;
+		s = servos[i];
+		if(!s)return -ENODEV;
+		if(mdeg[i] > s->range)return -EINVAL;
+		duty[i] = angle_duty(s, mdeg[i]);
+		if(duration || !s->velocity)continue;
+		t = (u64)abs((int)(mdeg[i] - s->angle)) * profile_peak[s->profile] * 1000000;
+		t = div_u64(t, s->velocity);
+		if(t > longest)longest = t;
+	}
+
+	if(longest == 0){
+		for(i = 0; i < SERVO_CHANNELS_MAX; i++)
+			if(mask & (1U << i))servo_stop(servos[i]);
+		return servo_group_apply(mask, mdeg, duty);
+	}
+
+	now = ktime_to_ns(ktime_get());
+	for(i = 0; i < SERVO_CHANNELS_MAX; i++){
+		if(!(mask & (1U << i)))continue;
+		s = servos[i];
+		s->from = s->angle;
+		s->to = mdeg[i];
+		s->start = now;
+		s->duration = longest;
+		servo_start(s);
+	}
+	wake_up_process(servo_task);
+	return 0;
+}
+
+/* one step of every move under way, all outputs together */
+static void servo_trajectory_tick(void)
+{
+	unsigned int duty[SERVO_CHANNELS_MAX];
+	u32 mask = 0, done = 0, angles[SERVO_CHANNELS_MAX];
+	struct servo *s;
+	s64 elapsed, now = ktime_to_ns(ktime_get());
+	u32 tau;
+	int i;
+
+	mutex_lock(&servo_mutex);
+	for(i = 0; i < SERVO_CHANNELS_MAX; i++){
+		s = servos[i];
+		if(!s || !s->moving)continue;
+		elapsed = now - s->start;
+		if(elapsed >= (s64)s->duration){
+			angles[i] = s->to;
+			done |= 1U << i;
+		}
+		else{
+			tau = div64_u64((u64)elapsed << 16, s->duration);
+			angles[i] = s->from + (int)((((s64)s->to - s->from) * profile_pos(s->profile, tau)) >> 16);
+		}
+		duty[i] = angle_duty(s, angles[i]);
+		mask |= 1U << i;
+	}
+	servo_group_apply(mask, angles, duty);
+	for(i = 0; i < SERVO_CHANNELS_MAX; i++)
+		if(done & (1U << i))servo_stop(servos[i]);
+	mutex_unlock(&servo_mutex);
+}
+
+/* the seqcount read side against the userspace writer */
+static void setpoints_poll(void)
+{
+	struct servo_group group;
+	u32 seq;
+	int err;
+
+	seq = ACCESS_ONCE(setpoints->seq);
+	if((seq & 1) || seq == setpoints_seq)return;
+	smp_rmb();
+	memcpy(&group, &setpoints->group, sizeof(group));
+	smp_rmb();
+	if(ACCESS_ONCE(setpoints->seq) != seq)return;
+	setpoints_seq = seq;
+	mutex_lock(&servo_mutex);
+	err = servo_group_set(group.mask, group.angle, group.duration);
+	mutex_unlock(&servo_mutex);
+	ACCESS_ONCE(setpoints->status) = err;
+	smp_wmb();
+	ACCESS_ONCE(setpoints->applied) = seq;
+}
+
+/* the shortest channel period, the page is not read and a move not
+ * stepped faster than any output could take it */
+static unsigned int poll_period(void)
+{
+	unsigned int period = PWM_PERIOD;
+	int i, first = 1;
+
+	mutex_lock(&servo_mutex);
+	for(i = 0; i < SERVO_CHANNELS_MAX; i++){
+		if(!servos[i])continue;
+		if(first || servos[i]->period < period)period = servos[i]->period;
+		first = 0;
+	}
+	mutex_unlock(&servo_mutex);
+	return period;
+}
+
+/* pwm_config() may sleep, so the page is polled and the moves stepped
+ * from a thread on an absolute hrtimer, a new pulse width is only taken
+ * once a period anyway. It sleeps while there is neither. */
+static int servo_thread(void *data)
+{
+	ktime_t next = ktime_get(), now;
 
-/* attributes */
-static struct class_attribute angle_attr = __ATTR(angle, 0660, angle_show, angle_store);
+	for(;;){
+		if(atomic_read(&setpoints_maps))setpoints_poll();
+		if(ACCESS_ONCE(servo_moving))servo_trajectory_tick();
+		set_current_state(TASK_INTERRUPTIBLE);
+		if(kthread_should_stop())break;
+		if(!atomic_read(&setpoints_maps) && !ACCESS_ONCE(servo_moving)){
+			schedule();
+			next = ktime_get();
+			continue;
+		}
+		next = ktime_add_ns(next, poll_period());
+		now = ktime_get();
+		if(ktime_to_ns(next) < ktime_to_ns(now))next = now;
+		schedule_hrtimeout(&next, HRTIMER_MODE_ABS);
+	}
+	__set_current_state(TASK_RUNNING);
+	return 0;
+}
+
+static void setpoints_vm_open(struct vm_area_struct *vma)
+{
+	atomic_inc(&setpoints_maps);
+	wake_up_process(servo_task);
+}
 
-static ssize_t angle_show(struct class *cls, struct class_attribute *attr, char *buf)
+static void setpoints_vm_close(struct vm_area_struct *vma)
 {
-	return sprintf(buf, "%u", angle);
+	atomic_dec(&setpoints_maps);
 }
 
-static ssize_t angle_store(struct class *cls, struct class_attribute *attr, const char *buf, size_t count)
+static const struct vm_operations_struct setpoints_vm_ops = {
+	.open = setpoints_vm_open,
+	.close = setpoints_vm_close,
+};
+
+static int servo_mmap(struct file *file, struct vm_area_struct *vma)
 {
+	int err;
+
+	if(vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start != PAGE_SIZE)return -EINVAL;
+	err = remap_pfn_range(vma, vma->vm_start, virt_to_phys(setpoints) >> PAGE_SHIFT, PAGE_SIZE, vma->vm_page_prot);
+	if(err)return err;
+	vma->vm_ops = &setpoints_vm_ops;
+	setpoints_vm_open(vma);
+	return 0;
+}
+
+static int servo_open(struct inode *inode, struct file *file)
+{
+	return nonseekable_open(inode, file);
+}
+
+/* any number of whole struct servo_group records, applied in order */
+static ssize_t servo_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
+{
+	struct servo_group group;
+	size_t done;
+	int err = 0;
+
+	if(count % sizeof(group))return -EINVAL;
+	for(done = 0; done < count; done += sizeof(group)){
+		if(copy_from_user(&group, buf + done, sizeof(group))){
+			err = -EFAULT;
+			break;
+		}
+		mutex_lock(&servo_mutex);
+		err = servo_group_set(group.mask, group.angle, group.duration);
+		mutex_unlock(&servo_mutex);
+		if(err)break;
+	}
+	return done ? done : err;
+}
+
+static long servo_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct servo_group group;
+	struct servo *s;
+	s64 left, now = ktime_to_ns(ktime_get());
+	int i;
+
+	if(cmd != SERVO_IOC_GET)return -ENOTTY;
+	memset(&group, 0, sizeof(group));
+	mutex_lock(&servo_mutex);
+	for(i = 0; i < SERVO_CHANNELS_MAX; i++){
+		s = servos[i];
+		if(!s)continue;
+		group.mask |= 1U << i;
+		group.angle[i] = s->angle;
+		if(!s->moving)continue;
+		left = s->start + (s64)s->duration - now;
+		if(left > 0 && div_s64(left + NSEC_PER_MSEC - 1, NSEC_PER_MSEC) > group.duration)
+			group.duration = div_s64(left + NSEC_PER_MSEC - 1, NSEC_PER_MSEC);
+	}
+	mutex_unlock(&servo_mutex);
+	return copy_to_user((void __user *)arg, &group, sizeof(group)) ? -EFAULT : 0;
+}
+
+static const struct file_operations servo_fops = {
+	.owner = THIS_MODULE,
+	.open = servo_open,
+	.write = servo_write,
+	.unlocked_ioctl = servo_ioctl,
+	.mmap = servo_mmap,
+	.llseek = no_llseek,
+};
+
+/* channel attributes */
+static ssize_t angle_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct servo *s = dev_get_drvdata(dev);
+	return sprintf(buf, "%u", (s->angle + 500) / 1000);
+}
+
+static ssize_t set_angle(struct servo *s, unsigned int mdeg, size_t count)
+{
+	u32 angles[SERVO_CHANNELS_MAX];
+	int err;
+	angles[s->id] = mdeg;
+	mutex_lock(&servo_mutex);
+	err = servo_group_set(1U << s->id, angles, 0);
+	mutex_unlock(&servo_mutex);
+	return err ? err : count;
+}
+
+static ssize_t angle_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct servo *s = dev_get_drvdata(dev);
+	unsigned int tmp;
+	if(sscanf(buf, "%u", &tmp) != 1 || tmp > s->range / 1000)return -EINVAL;
+	return set_angle(s, tmp * 1000, count);
+}
+
+static ssize_t angle_mdeg_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct servo *s = dev_get_drvdata(dev);
+	return sprintf(buf, "%u", s->angle);
+}
+
+static ssize_t angle_mdeg_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct servo *s = dev_get_drvdata(dev);
+	unsigned int tmp;
+	if(sscanf(buf, "%u", &tmp) != 1)return -EINVAL;
+	return set_angle(s, tmp, count);
+}
+
+static ssize_t duty_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct servo *s = dev_get_drvdata(dev);
+	return sprintf(buf, "%u", s->duty);
+}
+
+/* ns of pulse, outside the calibrated range too for finding its ends;
+ * the angle reads back as the nearest one in range */
+static ssize_t duty_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct servo *s = dev_get_drvdata(dev);
+	unsigned int tmp;
+	int err;
+	if(sscanf(buf, "%u", &tmp) != 1)return -EINVAL;
+	mutex_lock(&servo_mutex);
+	err = tmp > s->period ? -EINVAL : servo_apply(s, tmp, s->period);
+	if(!err){
+		servo_stop(s);
+		s->duty = tmp;
+		tmp = clamp_t(unsigned int, tmp, s->min_pulse, s->max_pulse);
+		s->angle = div_u64((u64)(tmp - s->min_pulse) * s->range, s->max_pulse - s->min_pulse);
+	}
+	mutex_unlock(&servo_mutex);
+	return err ? err : count;
+}
+
+static ssize_t period_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct servo *s = dev_get_drvdata(dev);
+	return sprintf(buf, "%u", s->period);
+}
+
+/* the pulse width stays, only the frame rate changes; for every PRU
+ * channel at once */
+static ssize_t period_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct servo *s = dev_get_drvdata(dev);
 	unsigned int tmp;
-	sscanf(buf, "%u", &tmp);
-	if(tmp < 0 || tmp > 180)return -EINVAL;
-	angle = tmp;
-	angle_duty = MIN_DUTY + ANGLE_CONST * angle;
-	pwm_config(angle_pwm, angle_duty, PWM_PERIOD);
+	int err;
+	if(sscanf(buf, "%u", &tmp) != 1 || tmp > PERIOD_MAX)return -EINVAL;
+	/* the pulses are checked under the lock, a PRU period against every
+	 * PRU channel */
+	mutex_lock(&servo_mutex);
+	if(s->pru >= 0)err = pru_period_set(tmp);
+	else if(tmp < s->max_pulse || tmp < s->duty)err = -EINVAL;
+	else{
+		err = servo_apply(s, s->duty, tmp);
+		if(!err)s->period = tmp;
+	}
+	mutex_unlock(&servo_mutex);
+	return err ? err : count;
+}
+
+static ssize_t calibration_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct servo *s = dev_get_drvdata(dev);
+	return sprintf(buf, "%u %u %u", s->min_pulse, s->max_pulse, s->range);
+}
+
+/* "min_pulse max_pulse range", ns and millidegrees; a move under way
+ * stops and the output jumps to where the current angle now is */
+static ssize_t calibration_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct servo *s = dev_get_drvdata(dev);
+	unsigned int lo, hi, range, duty[SERVO_CHANNELS_MAX];
+	u32 angles[SERVO_CHANNELS_MAX];
+	int err;
+	if(sscanf(buf, "%u %u %u", &lo, &hi, &range) != 3)return -EINVAL;
+	if(lo >= hi || range == 0)return -EINVAL;
+	mutex_lock(&servo_mutex);
+	if(hi > s->period){
+		mutex_unlock(&servo_mutex);
+		return -EINVAL;
+	}
+	servo_stop(s);
+	s->min_pulse = lo;
+	s->max_pulse = hi;
+	s->range = range;
+	angles[s->id] = min(s->angle, range);
+	duty[s->id] = angle_duty(s, angles[s->id]);
+	err = servo_group_apply(1U << s->id, angles, duty);
+	mutex_unlock(&servo_mutex);
+	return err ? err : count;
+}
+
+static ssize_t velocity_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct servo *s = dev_get_drvdata(dev);
+	return sprintf(buf, "%u", s->velocity);
+}
+
+/* millidegrees/s, angle writes and group writes without a duration move
+ * no faster; 0 jumps */
+static ssize_t velocity_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct servo *s = dev_get_drvdata(dev);
+	unsigned int tmp;
+	if(sscanf(buf, "%u", &tmp) != 1)return -EINVAL;
+	mutex_lock(&servo_mutex);
+	s->velocity = tmp;
+	mutex_unlock(&servo_mutex);
 	return count;
 }
 
+static ssize_t profile_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct servo *s = dev_get_drvdata(dev);
+	return sprintf(buf, "%s", profile_names[s->profile]);
+}
+
+/* taken by the next move */
+static ssize_t profile_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct servo *s = dev_get_drvdata(dev);
+	int len, profile, err = 0;
+	len = strlen(buf);
+	if(buf[len - 1] == '\n')len--;
+	for(profile = 0; profile < ARRAY_SIZE(profile_names); profile++)
+		if(len == strlen(profile_names[profile]) && strncmp(buf, profile_names[profile], len) == 0)break;
+	if(profile == ARRAY_SIZE(profile_names))return -EINVAL;
+	mutex_lock(&servo_mutex);
+	if(s->moving)err = -EBUSY;
+	else s->profile = profile;
+	mutex_unlock(&servo_mutex);
+	return err ? err : count;
+}
+
+/* "millidegrees ms", the move takes that long whatever the velocity */
+static ssize_t move_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct servo *s = dev_get_drvdata(dev);
+	unsigned int mdeg, ms;
+	u32 angles[SERVO_CHANNELS_MAX];
+	int err;
+	if(sscanf(buf, "%u %u", &mdeg, &ms) != 2)return -EINVAL;
+	angles[s->id] = mdeg;
+	mutex_lock(&servo_mutex);
+	err = servo_group_set(1U << s->id, angles, ms);
+	mutex_unlock(&servo_mutex);
+	return err ? err : count;
+}
+
+/* 1 while a move is under way, poll() wakes when it starts and ends */
+static ssize_t moving_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct servo *s = dev_get_drvdata(dev);
+	return sprintf(buf, "%i", s->moving);
+}
+
+static DEVICE_ATTR(angle, 0660, angle_show, angle_store);
+static DEVICE_ATTR(angle_mdeg, 0660, angle_mdeg_show, angle_mdeg_store);
+static DEVICE_ATTR(duty, 0660, duty_show, duty_store);
+static DEVICE_ATTR(period, 0660, period_show, period_store);
+static DEVICE_ATTR(calibration, 0660, calibration_show, calibration_store);
+static DEVICE_ATTR(velocity, 0660, velocity_show, velocity_store);
+static DEVICE_ATTR(profile, 0660, profile_show, profile_store);
+static DEVICE_ATTR(move, 0220, NULL, move_store);
+static DEVICE_ATTR(moving, 0444, moving_show, NULL);
+
+static struct attribute *servo_attr[] = {
+	&dev_attr_angle.attr,
+	&dev_attr_angle_mdeg.attr,
+	&dev_attr_duty.attr,
+	&dev_attr_period.attr,
+	&dev_attr_calibration.attr,
+	&dev_attr_velocity.attr,
+	&dev_attr_profile.attr,
+	&dev_attr_move.attr,
+	&dev_attr_moving.attr,
+	NULL,
+};
+
+static const struct attribute_group servo_attr_group = {
+	.attrs = servo_attr,
+};
+
+/* /sys/class/servo/group: millidegrees for channels 0, 1, ... in order,
+ * "-" leaves a channel as it is; all of them move together at the pace
+ * of the slowest velocity limit */
+static ssize_t group_show(struct class *cls, struct class_attribute *attr, char *buf)
+{
+	ssize_t len = 0;
+	int i;
+	mutex_lock(&servo_mutex);
+	for(i = 0; i < SERVO_CHANNELS_MAX; i++){
+		if(servos[i])len += sprintf(buf + len, "%u ", servos[i]->angle);
+		else len += sprintf(buf + len, "- ");
+	}
+	mutex_unlock(&servo_mutex);
+	buf[len - 1] = '\n';
+	return len;
+}
+
+static ssize_t group_store(struct class *cls, struct class_attribute *attr, const char *buf, size_t count)
+{
+	u32 mask = 0, angles[SERVO_CHANNELS_MAX];
+	const char *p = buf;
+	int i, n, err;
+
+	for(i = 0; i < SERVO_CHANNELS_MAX; i++){
+		while(*p == ' ' || *p == '\t')p++;
+		if(*p == '\0' || *p == '\n')break;
+		if(*p == '-' && (p[1] == ' ' || p[1] == '\t' || p[1] == '\n' || p[1] == '\0')){
+			p++;
+			continue;
+		}
+		if(sscanf(p, "%u%n", &angles[i], &n) != 1)return -EINVAL;
+		mask |= 1U << i;
+		p += n;
+	}
+	while(*p == ' ' || *p == '\t' || *p == '\n')p++;
+	if(*p != '\0')return -EINVAL;
+	mutex_lock(&servo_mutex);
+	err = servo_group_set(mask, angles, 0);
+	mutex_unlock(&servo_mutex);
+	return err ? err : count;
+}
+
+static struct class_attribute group_attr = __ATTR(group, 0660, group_show, group_store);
+
+/* the channel output, running at its initial duty */
+static int output_start(struct servo *s, struct device *dev)
+{
+	int err;
+
+	if(s->pru >= 0){
+		err = pru_attach(s, dev);
+		if(err)return err;
+	}
+	else{
+		s->pwm = pwm_request(s->pwm_id, "servo");
+		if(IS_ERR_OR_NULL(s->pwm)){
+			printk(KERN_ERR "%s: Cannot use PWM%i\n", DRVNAME, s->pwm_id);
+			return -ENODEV;
+		}
+		err = pwm_config(s->pwm, s->duty, s->period);
+		if(err){
+			printk(KERN_ERR "%s: %s: PWM%i refuses the period(%i)\n", DRVNAME, __func__, s->pwm_id, err);
+			pwm_free(s->pwm);
+			return err;
+		}
+		pwm_set_polarity(s->pwm, PWM_POLARITY_NORMAL);
+		pwm_enable(s->pwm);
+	}
+	s->applied_duty = s->duty;
+	s->applied_period = s->period;
+	return 0;
+}
+
+static void output_stop(struct servo *s)
+{
+	if(s->pru >= 0){
+		pru_detach(s);
+		return;
+	}
+	pwm_config(s->pwm, 0, s->period);
+	pwm_disable(s->pwm);
+	pwm_free(s->pwm);
+}
+
+static int servo_probe(struct platform_device *pdev)
+{
+	struct device_node *np = pdev->dev.of_node;
+	struct servo *s;
+	u32 val;
+	int err;
+
+	s = kzalloc(sizeof(struct servo), GFP_KERNEL);
+	if(!s){
+		printk(KERN_ERR "%s: %s: cannot allocate memory\n", DRVNAME, __func__);
+		return -ENOMEM;
+	}
+	s->min_pulse = MIN_DUTY;
+	s->max_pulse = MAX_DUTY;
+	s->range = RANGE_MDEG;
+	s->period = PWM_PERIOD;
+	s->pwm_id = -1;
+	s->pru = -1;
+	s->pru_channel = -1;
+	/* an eHRPWM output, or a PRU bit driven by pru/servo */
+	if(of_property_read_u32(np, "pru", &val) == 0){
+		s->pru = val;
+		if(of_property_read_u32(np, "pru-channel", &val) == 0)s->pru_channel = val;
+		if(s->pru > 1 || s->pru_channel < 0 || s->pru_channel >= PRU_CHANNELS){
+			printk(KERN_ERR "%s: %s: invalid pru or pru-channel\n", DRVNAME, __func__);
+			err = -EINVAL;
+			goto err1;
+		}
+	}
+	else if(of_property_read_u32(np, "pwm", &val) == 0)s->pwm_id = val;
+	else{
+		printk(KERN_ERR "%s: %s: no pwm\n", DRVNAME, __func__);
+		err = -EINVAL;
+		goto err1;
+	}
+	of_property_read_u32(np, "min-pulse-ns", &s->min_pulse);
+	of_property_read_u32(np, "max-pulse-ns", &s->max_pulse);
+	of_property_read_u32(np, "range-mdeg", &s->range);
+	of_property_read_u32(np, "period-ns", &s->period);
+	of_property_read_u32(np, "max-velocity", &s->velocity);
+	if(s->min_pulse >= s->max_pulse || s->max_pulse > s->period || s->range == 0 || s->period > PERIOD_MAX){
+		printk(KERN_ERR "%s: %s: invalid calibration\n", DRVNAME, __func__);
+		err = -EINVAL;
+		goto err1;
+	}
+	s->angle = 0;
+	s->duty = s->min_pulse;
+	s->profile = PROFILE_MINJERK;
+
+	/* the channel registers under servo_mutex only when fully set up */
+	mutex_lock(&servo_mutex);
+	for(s->id = 0; s->id < SERVO_CHANNELS_MAX && servos[s->id]; s->id++);
+	if(s->id == SERVO_CHANNELS_MAX){
+		printk(KERN_ERR "%s: %s: too many channels\n", DRVNAME, __func__);
+		err = -ENOSPC;
+		goto err2;
+	}
+
+	err = output_start(s, &pdev->dev);
+	if(err)goto err2;
+
+	s->dev = device_create(servo_class, &pdev->dev, MKDEV(0, 0), s, "servo_%i", s->id);
+	if(IS_ERR(s->dev)){
+		printk(KERN_ERR "%s: %s: cannot create device\n", DRVNAME, __func__);
+		err = PTR_ERR(s->dev);
+		goto err3;
+	}
+	err = sysfs_create_group(&s->dev->kobj, &servo_attr_group);
+	if(err){
+		printk(KERN_ERR "%s: %s: cannot create sysfs entry(%i)\n", DRVNAME, __func__, err);
+		goto err4;
+	}
+
+	servos[s->id] = s;
+	mutex_unlock(&servo_mutex);
+	platform_set_drvdata(pdev, s);
+	if(s->pru >= 0)printk(KERN_INFO "%s: %s: channel %i on PRU%i r30.t%i\n", DRVNAME, __func__, s->id, s->pru, s->pru_channel);
+	else printk(KERN_INFO "%s: %s: channel %i on PWM%i\n", DRVNAME, __func__, s->id, s->pwm_id);
+	return 0;
+
+	err4:
+	device_unregister(s->dev);
+	err3:
+	output_stop(s);
+	err2:
+	mutex_unlock(&servo_mutex);
+	err1:
+	kfree(s);
+	return err;
+}
+
+static int servo_remove(struct platform_device *pdev)
+{
+	struct servo *s = platform_get_drvdata(pdev);
+
+	mutex_lock(&servo_mutex);
+	servo_stop(s);
+	servos[s->id] = NULL;
+	mutex_unlock(&servo_mutex);
+
+	sysfs_remove_group(&s->dev->kobj, &servo_attr_group);
+	device_unregister(s->dev);
+	mutex_lock(&servo_mutex);
+	output_stop(s);
+	mutex_unlock(&servo_mutex);
+	platform_set_drvdata(pdev, NULL);
+	printk(KERN_INFO "%s: %s: channel %i\n", DRVNAME, __func__, s->id);
+	kfree(s);
+	return 0;
+}
+
+static const struct of_device_id servo_of_match[] = {
+	{ .compatible = "rc,servo", },
+	{},
+};
+
+static struct platform_driver servo_driver = {
+	.driver = {
+		.name = "servo",
+		.owner = THIS_MODULE,
+		.of_match_table = servo_of_match,
+	},
+	.probe = servo_probe,
+	.remove = servo_remove,
+};
+
 static int __init servo_init(void)
 {
+	int err;
+
 	/* create entried in sysfs */
 	servo_class = class_create(THIS_MODULE, "servo");
 	if(servo_class == NULL){
 		printk(KERN_ERR "%s: Cannot create entry in sysfs", DRVNAME);
 		return -1;
 	}
-	
-	if(class_create_file(servo_class, &angle_attr) != 0){
+	if(class_create_file(servo_class, &group_attr) != 0){
 		printk(KERN_ERR "%s: Cannot create sysfs attribute\n", DRVNAME);
 		goto err1;
 	}
-	
-	angle_pwm = pwm_request(ANGLE_PWM, "angle_pwm");
-	if(angle_pwm == NULL)
-	{
-		printk(KERN_ERR "%s: Cannot use PWM output P8_13\n", DRVNAME);
+
+	setpoints = (struct servo_setpoints *)get_zeroed_page(GFP_KERNEL);
+	if(setpoints == NULL){
+		printk(KERN_ERR "%s: Cannot allocate the setpoint page\n", DRVNAME);
 		goto err2;
 	}
-	pwm_config(angle_pwm, angle_duty, PWM_PERIOD);
-	pwm_set_polarity(angle_pwm, PWM_POLARITY_NORMAL);
-	pwm_enable(angle_pwm);
+	servo_task = kthread_run(servo_thread, NULL, "servo");
+	if(IS_ERR(servo_task)){
+		printk(KERN_ERR "%s: Cannot start the setpoint thread\n", DRVNAME);
+		goto err3;
+	}
+	if(alloc_chrdev_region(&servo_devt, 0, 1, "servo") < 0){
+		printk(KERN_ERR "%s: alloc_chrdev_region failed\n", DRVNAME);
+		goto err4;
+	}
+	cdev_init(&servo_cdev, &servo_fops);
+	if(cdev_add(&servo_cdev, servo_devt, 1) != 0){
+		printk(KERN_ERR "%s: cdev_add failed\n", DRVNAME);
+		goto err5;
+	}
+	servo_dev = device_create(servo_class, NULL, servo_devt, NULL, "servo");
+	if(IS_ERR(servo_dev)){
+		printk(KERN_ERR "%s: Cannot create device\n", DRVNAME);
+		goto err6;
+	}
+
+	err = platform_driver_register(&servo_driver);
+	if(err){
+		printk(KERN_ERR "%s: Cannot register platform driver(%i)\n", DRVNAME, err);
+		goto err7;
+	}
+	printk(KERN_INFO "%s: Module loaded\n", DRVNAME);
 	return 0;
-	
+
+	err7:
+	device_destroy(servo_class, servo_devt);
+	err6:
+	cdev_del(&servo_cdev);
+	err5:
+	unregister_chrdev_region(servo_devt, 1);
+	err4:
+	kthread_stop(servo_task);
+	err3:
+	free_page((unsigned long)setpoints);
 	err2:
-	class_remove_file(servo_class, &angle_attr);
+	class_remove_file(servo_class, &group_attr);
 	err1:
 	class_destroy(servo_class);
 	return -1;
@@ -78,17 +1054,22 @@ static int __init servo_init(void)
 
 static void __exit servo_exit(void)
 {
-	pwm_config(angle_pwm, 0, 0);
-	pwm_disable(angle_pwm);
-	pwm_free(angle_pwm);
-
-	class_remove_file(servo_class, &angle_attr);
+	platform_driver_unregister(&servo_driver);
+	device_destroy(servo_class, servo_devt);
+	cdev_del(&servo_cdev);
+	unregister_chrdev_region(servo_devt, 1);
+	kthread_stop(servo_task);
+	free_page((unsigned long)setpoints);
+	class_remove_file(servo_class, &group_attr);
 	class_destroy(servo_class);
+	printk(KERN_INFO "%s: Module unloaded\n", DRVNAME);
 }
 
 module_init(servo_init);
 module_exit(servo_exit);
 
+MODULE_DEVICE_TABLE(of, servo_of_match);
+
 MODULE_AUTHOR("Adam Olek");
 MODULE_DESCRIPTION("Servo driver");
 MODULE_LICENSE("GPL");
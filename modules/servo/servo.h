@@ -0,0 +1,51 @@
+#ifndef SERVO_H
+#define SERVO_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/* channels probed from the devicetree, /sys/class/servo/servo_N */
+#define SERVO_CHANNELS_MAX 16
+
+/* record written to /dev/servo, the channels in mask move together and
+ * arrive together. duration is the ms the move takes; 0 gives each channel
+ * its max velocity and the group the time of the slowest one, a group
+ * with no velocity limit set jumps at once */
+struct servo_group {
+	__u32 mask;
+	__u32 duration;
+	__u32 angle[SERVO_CHANNELS_MAX];	/* millidegrees */
+};
+
+/* the page mmap()ed from /dev/servo, offset 0 and one page long. The
+ * driver reads it once every (shortest) PWM period whenever seq changed
+ * and is even: seq++ (odd), write group, seq++ (even), with barriers in
+ * between, see servo_setpoints_begin()/end(). A block seen torn is taken
+ * the next period. */
+struct servo_setpoints {
+	__u32 seq;	/* written by userspace only */
+	__u32 applied;	/* driver, seq of the last block taken */
+	__s32 status;	/* driver, 0 or -errno of that block */
+	struct servo_group group;
+};
+
+#ifndef __KERNEL__
+static inline void servo_setpoints_begin(volatile struct servo_setpoints *sp)
+{
+	sp->seq++;
+	__sync_synchronize();
+}
+
+static inline void servo_setpoints_end(volatile struct servo_setpoints *sp)
+{
+	__sync_synchronize();
+	sp->seq++;
+}
+#endif
+
+#define SERVO_IOC_MAGIC 's'
+/* mask holds the probed channels, angle their current angles and
+ * duration the ms until the last move under way ends */
+#define SERVO_IOC_GET _IOR(SERVO_IOC_MAGIC, 1, struct servo_group)
+
+#endif
@@ -1,10 +1,23 @@
 #include <linux/init.h>
 #include <linux/module.h>
+#include <linux/moduleparam.h>
 #include <linux/fs.h>
 #include <linux/device.h>
 #include <linux/gpio.h>
 #include <linux/pwm.h>
 #include <linux/string.h>
+#include <linux/mutex.h>
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/hrtimer.h>
+#include <linux/math64.h>
+#include <linux/cdev.h>
+#include <linux/uaccess.h>
+#include <linux/mm.h>
+
+#include "am335x_gpio.h"
+#include "dagu_encoder.h"
+#include "tb6612.h"
 
 #define DRVNAME "TB6612"
 
@@ -15,9 +28,21 @@
 #define STDBY 45
 #define PWMA   6 /* P8_13 */
 #define PWMB   5 /* P8_19 */
+/* default period, the speed loop also works in ns of it whatever the
+ * period set */
 #define MOTOR_PWM_PERIOD 10000000
-#define MOTOR_PWM_DUTY_MUL 100000
-#define MODE_SIZE 5
+#define MOTOR_PERIOD_MIN 1000
+#define MOTOR_PERIOD_MAX 100000000
+#define MODE_SIZE 6
+/* slew limits, duty percent per second */
+#define RAMP_MAX 10000
+
+/* speed loop, motor A runs on encoder channel A and B on B */
+#define PID_RATE_MIN 100
+#define PID_RATE_MAX 1000
+/* loop ticks the speed is measured over, one edge is a millimetre so a
+ * single tick holds no useful count at wheel speeds */
+#define PID_WINDOW 32
 
 static unsigned int motora_speed = 0, motorb_speed = 0;
 static char motora_mode[MODE_SIZE], motorb_mode[MODE_SIZE];
@@ -25,6 +50,55 @@ static unsigned char standby = 1;
 static struct class *tb6612_class;
 static struct pwm_device *motora_pwm;
 static struct pwm_device *motorb_pwm;
+static const char * const mode_names[] = {"stop", "cw", "ccw", "brake"};
+static const int motor_in1[2] = {AIN1, BIN1}, motor_in2[2] = {AIN2, BIN2};
+/* the bridges as driven now, TB6612_* and ns; writes matching them are
+ * skipped */
+static int motor_mode[2];
+static unsigned int motor_duty[2];
+/* PWMA and PWMB are both channels of ehrpwm2 and share its time base,
+ * so one period serves both bridges */
+static unsigned int motor_period = MOTOR_PWM_PERIOD;
+static dev_t tb6612_devt;
+static struct cdev tb6612_cdev;
+static struct device *tb6612_dev;
+/* mmap()ed setpoint block, polled by the control thread while mapped */
+static struct tb6612_setpoints *setpoints;
+static atomic_t setpoints_maps = ATOMIC_INIT(0);
+static u32 setpoints_seq;
+
+/* IN1/IN2 written to the GPIO bank registers, a pair on one bank (AIN1 and
+ * AIN2) then switches in one store without passing through brake or the
+ * opposite direction */
+static bool direct_gpio;
+module_param(direct_gpio, bool, S_IRUGO);
+MODULE_PARM_DESC(direct_gpio, "write IN1/IN2 pins to the AM335x GPIO registers");
+static struct am335x_gpio gpio_regs;
+
+struct pid_wheel {
+	int enabled;
+	int target;		/* um/s, the sign picks cw or ccw */
+	int measured;		/* um/s, the encoder does not tell direction */
+	s64 i_sum;		/* sum of the errors, um/s per tick */
+	unsigned long long edges[PID_WINDOW];
+	int slot;
+};
+
+/* motor_mutex serializes the loop with the sysfs stores driving the
+ * motors; gains are 1/1000 of ns duty per um/s (kp), per um (ki) and per
+ * um/s^2 (kd) */
+static DEFINE_MUTEX(motor_mutex);
+static struct pid_wheel wheels[2];
+static int pid_kp = 20000, pid_ki = 50000, pid_kd = 0;
+static unsigned int pid_rate = PID_RATE_MAX;
+static struct task_struct *control_task;
+
+/* requested mode and duty, with slew limits set the control thread
+ * walks the bridge there while ramping[] is set; 0 jumps */
+static unsigned int ramp_accel, ramp_decel;
+static int ramp_mode[2], ramping[2];
+static unsigned int ramp_duty[2];
+static unsigned long long (*encoder_edges)(int channel);
 
 /* show and store functions declarations */
 static ssize_t motora_speed_show(struct class *cls, struct class_attribute *attr, char *buf);
@@ -40,6 +114,30 @@ static ssize_t motorb_mode_store(struct class *cls, struct class_attribute *attr
 static ssize_t tb6612_standby_show(struct class *cls, struct class_attribute *attr, char *buf);
 static ssize_t tb6612_standby_store(struct class *cls, struct class_attribute *attr, const char *buf, size_t count);
 
+static ssize_t motora_target_show(struct class *cls, struct class_attribute *attr, char *buf);
+static ssize_t motora_target_store(struct class *cls, struct class_attribute *attr, const char *buf, size_t count);
+static ssize_t motorb_target_show(struct class *cls, struct class_attribute *attr, char *buf);
+static ssize_t motorb_target_store(struct class *cls, struct class_attribute *attr, const char *buf, size_t count);
+static ssize_t motora_measured_show(struct class *cls, struct class_attribute *attr, char *buf);
+static ssize_t motorb_measured_show(struct class *cls, struct class_attribute *attr, char *buf);
+static ssize_t pid_gains_show(struct class *cls, struct class_attribute *attr, char *buf);
+static ssize_t pid_gains_store(struct class *cls, struct class_attribute *attr, const char *buf, size_t count);
+static ssize_t pid_rate_show(struct class *cls, struct class_attribute *attr, char *buf);
+static ssize_t pid_rate_store(struct class *cls, struct class_attribute *attr, const char *buf, size_t count);
+static ssize_t motora_duty_show(struct class *cls, struct class_attribute *attr, char *buf);
+static ssize_t motora_duty_store(struct class *cls, struct class_attribute *attr, const char *buf, size_t count);
+static ssize_t motorb_duty_show(struct class *cls, struct class_attribute *attr, char *buf);
+static ssize_t motorb_duty_store(struct class *cls, struct class_attribute *attr, const char *buf, size_t count);
+static ssize_t period_show(struct class *cls, struct class_attribute *attr, char *buf);
+static ssize_t period_store(struct class *cls, struct class_attribute *attr, const char *buf, size_t count);
+static ssize_t accel_show(struct class *cls, struct class_attribute *attr, char *buf);
+static ssize_t accel_store(struct class *cls, struct class_attribute *attr, const char *buf, size_t count);
+static ssize_t decel_show(struct class *cls, struct class_attribute *attr, char *buf);
+static ssize_t decel_store(struct class *cls, struct class_attribute *attr, const char *buf, size_t count);
+
+static void set_inputs(int in1, int in2, int val1, int val2);
+static void setpoints_poll(void);
+
 /* attributes */
 static struct class_attribute motora_speed_attr = __ATTR(motora_speed, 0660, motora_speed_show, motora_speed_store);
 static struct class_attribute motorb_speed_attr = __ATTR(motorb_speed, 0660, motorb_speed_show, motorb_speed_store);
@@ -47,21 +145,480 @@ static struct class_attribute motora_mode_attr = __ATTR(motora_mode, 0660, motor
 static struct class_attribute motorb_mode_attr = __ATTR(motorb_mode, 0660, motorb_mode_show, motorb_mode_store);
 static struct class_attribute tb6612_standby_attr = __ATTR(standby, 0660, tb6612_standby_show, tb6612_standby_store);
 
-static ssize_t motora_speed_show(struct class *cls, struct class_attribute *attr, char *buf)
+/* duty, period, speed loop and ramp attributes, created and removed
+ * together */
+static struct class_attribute pid_attrs[] = {
+	__ATTR(motora_target, 0660, motora_target_show, motora_target_store),
+	__ATTR(motorb_target, 0660, motorb_target_show, motorb_target_store),
+	__ATTR(motora_measured, 0440, motora_measured_show, NULL),
+	__ATTR(motorb_measured, 0440, motorb_measured_show, NULL),
+	__ATTR(pid_gains, 0660, pid_gains_show, pid_gains_store),
+	__ATTR(pid_rate, 0660, pid_rate_show, pid_rate_store),
+	__ATTR(motora_duty, 0660, motora_duty_show, motora_duty_store),
+	__ATTR(motorb_duty, 0660, motorb_duty_show, motorb_duty_store),
+	__ATTR(period, 0660, period_show, period_store),
+	__ATTR(accel, 0660, accel_show, accel_store),
+	__ATTR(decel, 0660, decel_show, decel_store),
+};
+
+static void set_inputs(int in1, int in2, int val1, int val2)
 {
-	return sprintf(buf, "%u", motora_speed);
+	u32 mask1 = AM335X_GPIO_BIT(in1), mask2 = AM335X_GPIO_BIT(in2);
+	int bank1 = AM335X_GPIO_BANK(in1), bank2 = AM335X_GPIO_BANK(in2);
+
+	if(!direct_gpio){
+		gpio_set_value(in1, val1);
+		gpio_set_value(in2, val2);
+	}
+	else if(bank1 == bank2)
+		am335x_gpio_write(&gpio_regs, bank1, mask1 | mask2, (val1 ? mask1 : 0) | (val2 ? mask2 : 0));
+	else{
+		am335x_gpio_set(&gpio_regs, in1, val1);
+		am335x_gpio_set(&gpio_regs, in2, val2);
+	}
 }
 
-static ssize_t motora_speed_store(struct class *cls, struct class_attribute *attr, const char *buf, size_t count)
+/* the pins change together: interrupts stay off over the whole set and
+ * with direct_gpio each bank takes a single store */
+static void set_pins(const int *pins, const int *vals, int n)
+{
+	u32 mask[AM335X_GPIO_BANKS] = {0}, value[AM335X_GPIO_BANKS] = {0};
+	unsigned long flags;
+	int i, bank;
+
+	local_irq_save(flags);
+	for(i = 0; i < n; i++){
+		if(!direct_gpio){
+			gpio_set_value(pins[i], vals[i]);
+			continue;
+		}
+		bank = AM335X_GPIO_BANK(pins[i]);
+		mask[bank] |= AM335X_GPIO_BIT(pins[i]);
+		if(vals[i])value[bank] |= AM335X_GPIO_BIT(pins[i]);
+	}
+	for(i = 0; i < AM335X_GPIO_BANKS; i++)
+		if(mask[i])am335x_gpio_write(&gpio_regs, i, mask[i], value[i]);
+	local_irq_restore(flags);
+}
+
+/* drives motor m (0 A, 1 B) now, only what changed is written; brake
+ * is IN1 = IN2 = 1, the TB6612 short brake */
+static void motor_write(int m, int mode, unsigned int duty)
+{
+	if(mode != motor_mode[m]){
+		set_inputs(motor_in1[m], motor_in2[m], mode == TB6612_CCW || mode == TB6612_BRAKE,
+			mode == TB6612_CW || mode == TB6612_BRAKE);
+		motor_mode[m] = mode;
+	}
+	/* PWMB is gone when it could not be requested again after a period
+	 * change */
+	if(duty != motor_duty[m] && (m == 0 || motorb_pwm != NULL)){
+		pwm_config(m ? motorb_pwm : motora_pwm, duty, motor_period);
+		motor_duty[m] = duty;
+	}
+}
+
+/* what motor m is asked for, shown through motorX_mode and motorX_speed */
+static void motor_requested(int m, int mode, unsigned int duty)
+{
+	ramp_mode[m] = mode;
+	ramp_duty[m] = duty;
+	strcpy(m ? motorb_mode : motora_mode, mode_names[mode]);
+	if(m == 0)motora_speed = div_u64((u64)duty * 100, motor_period);
+	else motorb_speed = div_u64((u64)duty * 100, motor_period);
+}
+
+/* sets motor m going to mode and duty, motor_mutex held. Brake and
+ * unlimited slew apply at once, anything else is left to ramp_tick() */
+static void motor_request(int m, int mode, unsigned int duty)
+{
+	motor_requested(m, mode, duty);
+	if(mode == TB6612_BRAKE || (!ramp_accel && !ramp_decel)){
+		ramping[m] = 0;
+		motor_write(m, mode, duty);
+		return;
+	}
+	ramping[m] = 1;
+	wake_up_process(control_task);
+}
+
+/* one control tick of slew for motor m, motor_mutex held; a change of
+ * mode while driving runs the duty down to 0 first. 0 once there. */
+static int ramp_tick(int m)
+{
+	unsigned int duty = motor_duty[m], target = ramp_duty[m], up, down;
+	int driving = motor_mode[m] == TB6612_CW || motor_mode[m] == TB6612_CCW;
+
+	up = ramp_accel ? div_u64((u64)ramp_accel * motor_period, 100 * pid_rate) : motor_period;
+	down = ramp_decel ? div_u64((u64)ramp_decel * motor_period, 100 * pid_rate) : motor_period;
+	if(up == 0)up = 1;
+	if(down == 0)down = 1;
+	if(ramp_mode[m] != motor_mode[m]){
+		if(driving && duty > 0){
+			motor_write(m, motor_mode[m], duty > down ? duty - down : 0);
+			return 1;
+		}
+		duty = 0;
+		motor_write(m, ramp_mode[m], 0);
+	}
+	if(duty < target)duty = target - duty > up ? duty + up : target;
+	else if(duty > target)duty = duty - target > down ? duty - down : target;
+	motor_write(m, ramp_mode[m], duty);
+	return duty != target;
+}
+
+/* one loop step for motor m, called with motor_mutex held. The encoder
+ * counts edges without direction, so the loop works on magnitudes and
+ * the sign of the target only picks the inputs. The derivative acts on
+ * the measurement to keep setpoint steps from kicking the output. The
+ * output is in ns of MOTOR_PWM_PERIOD, scaled to the motor period, so the
+ * gains hold when the period changes. */
+static void pid_tick(int m)
+{
+	struct pid_wheel *w = &wheels[m];
+	unsigned long long now = encoder_edges(m);
+	int target = abs(w->target), mode = w->target > 0 ? TB6612_CW : TB6612_CCW;
+	int measured, err, i;
+	s64 out, limit;
+
+	/* the encoder was reset under us, the window starts over from now and
+	 * this tick keeps the last speed */
+	if(now < w->edges[w->slot]){
+		for(i = 0; i < PID_WINDOW; i++)w->edges[i] = now;
+		measured = w->measured;
+	}
+	else measured = div_u64((now - w->edges[w->slot]) * DAGU_ENCODER_DIST_PER_SIG * pid_rate, PID_WINDOW);
+	w->edges[w->slot] = now;
+	w->slot = (w->slot + 1) % PID_WINDOW;
+
+	if(target == 0 || mode != motor_mode[m])w->i_sum = 0;
+	if(target == 0){
+		w->measured = measured;
+		motor_requested(m, TB6612_STOP, 0);
+		motor_write(m, TB6612_STOP, 0);
+		return;
+	}
+	err = target - measured;
+	out = (s64)pid_kp * err + div_s64((s64)pid_ki * (w->i_sum + err), pid_rate)
+		+ (s64)pid_kd * (w->measured - measured) * pid_rate;
+	out = div_s64(out, 1000);
+	w->measured = measured;
+
+	/* anti-windup: no integrating further into a saturated output, and
+	 * the integral alone never asks for more than the full period */
+	if((out < MOTOR_PWM_PERIOD || err < 0) && (out > 0 || err > 0))w->i_sum += err;
+	if(pid_ki > 0){
+		limit = div_s64((s64)MOTOR_PWM_PERIOD * 1000 * pid_rate, pid_ki);
+		if(w->i_sum > limit)w->i_sum = limit;
+		if(w->i_sum < 0)w->i_sum = 0;
+	}
+	if(out < 0)out = 0;
+	if(out > MOTOR_PWM_PERIOD)out = MOTOR_PWM_PERIOD;
+	out = div_u64((u64)out * motor_period, MOTOR_PWM_PERIOD);
+	motor_requested(m, mode, out);
+	motor_write(m, mode, out);
+}
+
+/* pwm_config() may sleep, so the speed loop, the ramps and the setpoint
+ * page run in a thread woken by an absolute hrtimer every 1/pid_rate; it
+ * sleeps for good while none of them needs it */
+static int control_thread(void *data)
+{
+	struct sched_param param = { .sched_priority = MAX_RT_PRIO / 2 };
+	ktime_t next = ktime_get(), now;
+	int m;
+
+	sched_setscheduler(current, SCHED_FIFO, &param);
+	for(;;){
+		mutex_lock(&motor_mutex);
+		if(atomic_read(&setpoints_maps))setpoints_poll();
+		for(m = 0; m < 2; m++){
+			if(wheels[m].enabled)pid_tick(m);
+			else if(ramping[m])ramping[m] = ramp_tick(m);
+		}
+		mutex_unlock(&motor_mutex);
+
+		set_current_state(TASK_INTERRUPTIBLE);
+		if(kthread_should_stop())break;
+		if(!wheels[0].enabled && !wheels[1].enabled && !ramping[0] && !ramping[1] &&
+			!atomic_read(&setpoints_maps)){
+			schedule();
+			next = ktime_get();
+			continue;
+		}
+		next = ktime_add_ns(next, NSEC_PER_SEC / pid_rate);
+		now = ktime_get();
+		/* late by more than a period, ticks are dropped, not caught up */
+		if(ktime_to_ns(next) < ktime_to_ns(now))next = now;
+		schedule_hrtimeout(&next, HRTIMER_MODE_ABS);
+	}
+	__set_current_state(TASK_RUNNING);
+	return 0;
+}
+
+/* hands motor m back to the sysfs speed and mode, motor_mutex held */
+static void pid_release(int m)
+{
+	wheels[m].enabled = 0;
+}
+
+static ssize_t target_show(int m, char *buf)
+{
+	if(!wheels[m].enabled)return sprintf(buf, "off");
+	return sprintf(buf, "%i", wheels[m].target);
+}
+
+/* a target puts motor m under the loop until its speed or mode is
+ * written again */
+static ssize_t target_store(int m, const char *buf, size_t count)
+{
+	struct pid_wheel *w = &wheels[m];
+	int tmp, i;
+
+	if(sscanf(buf, "%i", &tmp) != 1)return -EINVAL;
+	mutex_lock(&motor_mutex);
+	if(encoder_edges == NULL)encoder_edges = symbol_get(dagu_encoder_edges);
+	if(encoder_edges == NULL){
+		mutex_unlock(&motor_mutex);
+		return -ENODEV;
+	}
+	if(!w->enabled){
+		for(i = 0; i < PID_WINDOW; i++)w->edges[i] = encoder_edges(m);
+		w->slot = 0;
+		w->measured = 0;
+		w->i_sum = 0;
+		w->enabled = 1;
+		ramping[m] = 0;
+	}
+	w->target = tmp;
+	mutex_unlock(&motor_mutex);
+	wake_up_process(control_task);
+	return count;
+}
+
+static ssize_t motora_target_show(struct class *cls, struct class_attribute *attr, char *buf)
+{
+	return target_show(0, buf);
+}
+
+static ssize_t motora_target_store(struct class *cls, struct class_attribute *attr, const char *buf, size_t count)
+{
+	return target_store(0, buf, count);
+}
+
+static ssize_t motorb_target_show(struct class *cls, struct class_attribute *attr, char *buf)
+{
+	return target_show(1, buf);
+}
+
+static ssize_t motorb_target_store(struct class *cls, struct class_attribute *attr, const char *buf, size_t count)
+{
+	return target_store(1, buf, count);
+}
+
+static ssize_t motora_measured_show(struct class *cls, struct class_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%i", wheels[0].measured);
+}
+
+static ssize_t motorb_measured_show(struct class *cls, struct class_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%i", wheels[1].measured);
+}
+
+static ssize_t pid_gains_show(struct class *cls, struct class_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%i %i %i", pid_kp, pid_ki, pid_kd);
+}
+
+static ssize_t pid_gains_store(struct class *cls, struct class_attribute *attr, const char *buf, size_t count)
+{
+	int kp, ki, kd;
+	if(sscanf(buf, "%i %i %i", &kp, &ki, &kd) != 3)return -EINVAL;
+	if(kp < 0 || ki < 0 || kd < 0)return -EINVAL;
+	mutex_lock(&motor_mutex);
+	pid_kp = kp;
+	pid_ki = ki;
+	pid_kd = kd;
+	mutex_unlock(&motor_mutex);
+	return count;
+}
+
+static ssize_t pid_rate_show(struct class *cls, struct class_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u", pid_rate);
+}
+
+/* the window is in ticks, the integral and speed are rescaled with it */
+static ssize_t pid_rate_store(struct class *cls, struct class_attribute *attr, const char *buf, size_t count)
+{
+	unsigned int tmp;
+	if(sscanf(buf, "%u", &tmp) != 1)return -EINVAL;
+	if(tmp < PID_RATE_MIN || tmp > PID_RATE_MAX)return -EINVAL;
+	mutex_lock(&motor_mutex);
+	wheels[0].i_sum = div_s64(wheels[0].i_sum * tmp, pid_rate);
+	wheels[1].i_sum = div_s64(wheels[1].i_sum * tmp, pid_rate);
+	pid_rate = tmp;
+	mutex_unlock(&motor_mutex);
+	return count;
+}
+
+static ssize_t accel_show(struct class *cls, struct class_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u", ramp_accel);
+}
+
+static ssize_t accel_store(struct class *cls, struct class_attribute *attr, const char *buf, size_t count)
+{
+	unsigned int tmp;
+	if(sscanf(buf, "%u", &tmp) != 1 || tmp > RAMP_MAX)return -EINVAL;
+	mutex_lock(&motor_mutex);
+	ramp_accel = tmp;
+	mutex_unlock(&motor_mutex);
+	return count;
+}
+
+static ssize_t decel_show(struct class *cls, struct class_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u", ramp_decel);
+}
+
+static ssize_t decel_store(struct class *cls, struct class_attribute *attr, const char *buf, size_t count)
+{
+	unsigned int tmp;
+	if(sscanf(buf, "%u", &tmp) != 1 || tmp > RAMP_MAX)return -EINVAL;
+	mutex_lock(&motor_mutex);
+	ramp_decel = tmp;
+	mutex_unlock(&motor_mutex);
+	return count;
+}
+
+static ssize_t speed_store(int m, const char *buf, size_t count)
 {
 	unsigned int tmp;
 	sscanf(buf, "%u", &tmp);
 	if(tmp < 0 || tmp > 100)return -EINVAL;
-	motora_speed = tmp;
-	pwm_config(motora_pwm, motora_speed * MOTOR_PWM_DUTY_MUL, MOTOR_PWM_PERIOD);
+	mutex_lock(&motor_mutex);
+	pid_release(m);
+	motor_request(m, ramp_mode[m], div_u64((u64)tmp * motor_period, 100));
+	mutex_unlock(&motor_mutex);
 	return count;
 }
 
+/* ns, the requested duty */
+static ssize_t duty_store(int m, const char *buf, size_t count)
+{
+	unsigned int tmp;
+	int err = 0;
+	if(sscanf(buf, "%u", &tmp) != 1)return -EINVAL;
+	mutex_lock(&motor_mutex);
+	if(tmp > motor_period)err = -EINVAL;
+	else{
+		pid_release(m);
+		motor_request(m, ramp_mode[m], tmp);
+	}
+	mutex_unlock(&motor_mutex);
+	return err ? err : count;
+}
+
+static ssize_t motora_duty_show(struct class *cls, struct class_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u", ramp_duty[0]);
+}
+
+static ssize_t motora_duty_store(struct class *cls, struct class_attribute *attr, const char *buf, size_t count)
+{
+	return duty_store(0, buf, count);
+}
+
+static ssize_t motorb_duty_show(struct class *cls, struct class_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u", ramp_duty[1]);
+}
+
+static ssize_t motorb_duty_store(struct class *cls, struct class_attribute *attr, const char *buf, size_t count)
+{
+	return duty_store(1, buf, count);
+}
+
+static ssize_t period_show(struct class *cls, struct class_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u", motor_period);
+}
+
+/* ns, for both bridges; the duties are kept as the same part of the new
+ * period. The PWM driver refuses a period that differs from the other
+ * channel's until that one is freed, so PWMB is given back while PWMA
+ * takes the new period and then requested again. */
+static ssize_t period_store(struct class *cls, struct class_attribute *attr, const char *buf, size_t count)
+{
+	unsigned int tmp, duty[2];
+	int m, err;
+	if(sscanf(buf, "%u", &tmp) != 1 || tmp < MOTOR_PERIOD_MIN || tmp > MOTOR_PERIOD_MAX)return -EINVAL;
+	mutex_lock(&motor_mutex);
+	if(motorb_pwm == NULL){
+		mutex_unlock(&motor_mutex);
+		return -ENODEV;
+	}
+	for(m = 0; m < 2; m++)duty[m] = div_u64((u64)motor_duty[m] * tmp, motor_period);
+	pwm_disable(motora_pwm);
+	pwm_disable(motorb_pwm);
+	pwm_free(motorb_pwm);
+	err = pwm_config(motora_pwm, duty[0], tmp);
+	/* both stay at the old period */
+	if(err){
+		duty[0] = motor_duty[0];
+		duty[1] = motor_duty[1];
+		tmp = motor_period;
+	}
+	motorb_pwm = pwm_request(PWMB, "motorb_pwm");
+	if(IS_ERR_OR_NULL(motorb_pwm)){
+		printk(KERN_ERR "%s: Cannot use PWM output P8_19 again, motor B is off\n", DRVNAME);
+		motorb_pwm = NULL;
+		err = -ENODEV;
+	}
+	else{
+		pwm_config(motorb_pwm, duty[1], tmp);
+		pwm_set_polarity(motorb_pwm, PWM_POLARITY_NORMAL);
+		pwm_enable(motorb_pwm);
+	}
+	pwm_enable(motora_pwm);
+	if(tmp != motor_period){
+		for(m = 0; m < 2; m++){
+			ramp_duty[m] = div_u64((u64)ramp_duty[m] * tmp, motor_period);
+			motor_duty[m] = duty[m];
+		}
+		motor_period = tmp;
+	}
+	mutex_unlock(&motor_mutex);
+	return err ? err : count;
+}
+
+static ssize_t mode_store(int m, const char *buf, size_t count)
+{
+	int len, mode;
+	len = strlen(buf);
+	if(buf[len - 1] == '\n')len--;
+	for(mode = 0; mode < ARRAY_SIZE(mode_names); mode++)
+		if(len == strlen(mode_names[mode]) && strncmp(buf, mode_names[mode], len) == 0)break;
+	if(mode == ARRAY_SIZE(mode_names))return -EINVAL;
+	mutex_lock(&motor_mutex);
+	pid_release(m);
+	motor_request(m, mode, ramp_duty[m]);
+	mutex_unlock(&motor_mutex);
+	return count;
+}
+
+static ssize_t motora_speed_show(struct class *cls, struct class_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u", motora_speed);
+}
+
+static ssize_t motora_speed_store(struct class *cls, struct class_attribute *attr, const char *buf, size_t count)
+{
+	return speed_store(0, buf, count);
+}
+
 static ssize_t motorb_speed_show(struct class *cls, struct class_attribute *attr, char *buf)
 {
 	return sprintf(buf, "%u", motorb_speed);
@@ -69,12 +626,7 @@ static ssize_t motorb_speed_show(struct class *cls, struct class_attribute *attr
 
 static ssize_t motorb_speed_store(struct class *cls, struct class_attribute *attr, const char *buf, size_t count)
 {
-	unsigned int tmp;
-	sscanf(buf, "%u", &tmp);
-	if(tmp < 0 || tmp > 100)return -EINVAL;
-	motorb_speed = tmp;
-	pwm_config(motorb_pwm, motorb_speed * MOTOR_PWM_DUTY_MUL, MOTOR_PWM_PERIOD);
-	return count;
+	return speed_store(1, buf, count);
 }
 
 
@@ -85,27 +637,7 @@ static ssize_t motora_mode_show(struct class *cls, struct class_attribute *attr,
 
 static ssize_t motora_mode_store(struct class *cls, struct class_attribute *attr, const char *buf, size_t count)
 {
-	int len;
-	len = strlen(buf);
-	if(buf[len - 1] == '\n')len--;
-	if(len > 4)return -EINVAL;
-	if(strncmp(buf, "stop", len) != 0 && strncmp(buf, "cw", len) != 0 && strncmp(buf, "ccw", len) != 0)return -EINVAL;
-	memset(motora_mode, '\0', MODE_SIZE);
-	strncpy(motora_mode, buf, len);
-	if(strcmp(motora_mode, "stop") == 0){
-		gpio_set_value(AIN1, 0);
-		gpio_set_value(AIN2, 0);
-	}
-	else if(strcmp(motora_mode, "cw") == 0){
-		gpio_set_value(AIN1, 0);
-		gpio_set_value(AIN2, 1);
-	}
-	else if(strcmp(motora_mode, "ccw") == 0){
-		gpio_set_value(AIN1, 1);
-		gpio_set_value(AIN2, 0);
-	}
-	else return -EINVAL;
-	return count;
+	return mode_store(0, buf, count);
 }
 
 static ssize_t motorb_mode_show(struct class *cls, struct class_attribute *attr, char *buf)
@@ -115,28 +647,7 @@ static ssize_t motorb_mode_show(struct class *cls, struct class_attribute *attr,
 
 static ssize_t motorb_mode_store(struct class *cls, struct class_attribute *attr, const char *buf, size_t count)
 {
-	int len;
-	len = strlen(buf);
-	if(buf[len - 1] == '\n')len--;
-	if(len > 4)return -EINVAL;
-	if(strncmp(buf, "stop", len) != 0 && strncmp(buf, "cw", len) != 0 && strncmp(buf, "ccw", len) != 0)return -EINVAL;
-	memset(motorb_mode, '\0', MODE_SIZE);
-	strncpy(motorb_mode, buf, len);
-	if(strcmp(motorb_mode, "stop") == 0){
-		gpio_set_value(BIN1, 0);
-		gpio_set_value(BIN2, 0);
-	}
-	else if(strcmp(motorb_mode, "cw") == 0){
-		gpio_set_value(BIN1, 0);
-		gpio_set_value(BIN2, 1);
-	}
-	else if(strcmp(motorb_mode, "ccw") == 0){
-		gpio_set_value(BIN1, 1);
-		gpio_set_value(BIN2, 0);
-	}
-	else return -EINVAL;
-	return count;
-
+	return mode_store(1, buf, count);
 }
 
 
@@ -150,13 +661,173 @@ static ssize_t tb6612_standby_store(struct class *cls, struct class_attribute *a
 	unsigned int tmp;
 	sscanf(buf, "%u", &tmp);
 	if(tmp > 1)tmp = 1;
+	mutex_lock(&motor_mutex);
+	if(tmp != standby)gpio_set_value(STDBY, !tmp);
 	standby = tmp;
-	gpio_set_value(STDBY, !standby);
+	mutex_unlock(&motor_mutex);
 	return count;
 }
 
+/* one command for both bridges, motor_mutex held. Without slew limits
+ * both duties go first, the two channels of one ehrpwm load them at the
+ * same period start, then every IN and STBY pin is switched by set_pins()
+ * in one pass. With them both motors ramp on the same control ticks. */
+static int command_apply(const struct tb6612_command *cmd)
+{
+	int pins[5], vals[5], n = 0, m, mode;
+	int ramp = ramp_accel || ramp_decel;
+
+	if(cmd->flags & ~(TB6612_MOTOR_A | TB6612_MOTOR_B | TB6612_STANDBY))return -EINVAL;
+	for(m = 0; m < 2; m++){
+		if(!(cmd->flags & (TB6612_MOTOR_A << m)))continue;
+		if(cmd->motor[m].mode > TB6612_BRAKE || cmd->motor[m].duty > motor_period)return -EINVAL;
+	}
+
+	for(m = 0; m < 2; m++){
+		if(!(cmd->flags & (TB6612_MOTOR_A << m)))continue;
+		pid_release(m);
+		if(ramp){
+			motor_request(m, cmd->motor[m].mode, cmd->motor[m].duty);
+			continue;
+		}
+		motor_requested(m, cmd->motor[m].mode, cmd->motor[m].duty);
+		ramping[m] = 0;
+		motor_write(m, motor_mode[m], cmd->motor[m].duty);
+	}
+	for(m = 0; m < 2 && !ramp; m++){
+		if(!(cmd->flags & (TB6612_MOTOR_A << m)))continue;
+		mode = cmd->motor[m].mode;
+		if(mode == motor_mode[m])continue;
+		pins[n] = motor_in1[m];
+		vals[n++] = mode == TB6612_CCW || mode == TB6612_BRAKE;
+		pins[n] = motor_in2[m];
+		vals[n++] = mode == TB6612_CW || mode == TB6612_BRAKE;
+		motor_mode[m] = mode;
+	}
+	if((cmd->flags & TB6612_STANDBY) && !!cmd->standby != standby){
+		standby = !!cmd->standby;
+		pins[n] = STDBY;
+		vals[n++] = !standby;
+	}
+	if(n)set_pins(pins, vals, n);
+	return 0;
+}
+
+/* the seqcount read side against the userspace writer, motor_mutex held */
+static void setpoints_poll(void)
+{
+	struct tb6612_command cmd;
+	u32 seq;
+
+	seq = ACCESS_ONCE(setpoints->seq);
+	if((seq & 1) || seq == setpoints_seq)return;
+	smp_rmb();
+	memcpy(&cmd, &setpoints->cmd, sizeof(cmd));
+	smp_rmb();
+	if(ACCESS_ONCE(setpoints->seq) != seq)return;
+	setpoints_seq = seq;
+	ACCESS_ONCE(setpoints->status) = command_apply(&cmd);
+	smp_wmb();
+	ACCESS_ONCE(setpoints->applied) = seq;
+}
+
+static void setpoints_vm_open(struct vm_area_struct *vma)
+{
+	atomic_inc(&setpoints_maps);
+	wake_up_process(control_task);
+}
+
+static void setpoints_vm_close(struct vm_area_struct *vma)
+{
+	atomic_dec(&setpoints_maps);
+}
+
+static const struct vm_operations_struct setpoints_vm_ops = {
+	.open = setpoints_vm_open,
+	.close = setpoints_vm_close,
+};
+
+static int tb6612_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	int err;
+
+	if(vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start != PAGE_SIZE)return -EINVAL;
+	err = remap_pfn_range(vma, vma->vm_start, virt_to_phys(setpoints) >> PAGE_SHIFT, PAGE_SIZE, vma->vm_page_prot);
+	if(err)return err;
+	vma->vm_ops = &setpoints_vm_ops;
+	setpoints_vm_open(vma);
+	return 0;
+}
+
+static int tb6612_open(struct inode *inode, struct file *file)
+{
+	return nonseekable_open(inode, file);
+}
+
+/* any number of whole commands, applied in order */
+static ssize_t tb6612_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
+{
+	struct tb6612_command cmd;
+	size_t done;
+	int err = 0;
+
+	if(count % sizeof(cmd))return -EINVAL;
+	for(done = 0; done < count; done += sizeof(cmd)){
+		if(copy_from_user(&cmd, buf + done, sizeof(cmd))){
+			err = -EFAULT;
+			break;
+		}
+		mutex_lock(&motor_mutex);
+		err = command_apply(&cmd);
+		mutex_unlock(&motor_mutex);
+		if(err)break;
+	}
+	return done ? done : err;
+}
+
+static long tb6612_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct tb6612_command c;
+	int m, err;
+
+	if(cmd == TB6612_IOC_GET){
+		memset(&c, 0, sizeof(c));
+		c.flags = TB6612_MOTOR_A | TB6612_MOTOR_B | TB6612_STANDBY;
+		mutex_lock(&motor_mutex);
+		c.standby = standby;
+		for(m = 0; m < 2; m++){
+			c.motor[m].mode = motor_mode[m];
+			c.motor[m].duty = motor_duty[m];
+		}
+		mutex_unlock(&motor_mutex);
+		return copy_to_user((void __user *)arg, &c, sizeof(c)) ? -EFAULT : 0;
+	}
+	if(cmd != TB6612_IOC_SET)return -ENOTTY;
+	if(copy_from_user(&c, (void __user *)arg, sizeof(c)))return -EFAULT;
+	mutex_lock(&motor_mutex);
+	err = command_apply(&c);
+	mutex_unlock(&motor_mutex);
+	return err;
+}
+
+static const struct file_operations tb6612_fops = {
+	.owner = THIS_MODULE,
+	.open = tb6612_open,
+	.write = tb6612_write,
+	.unlocked_ioctl = tb6612_ioctl,
+	.mmap = tb6612_mmap,
+	.llseek = no_llseek,
+};
+
+static void pid_attrs_remove(int n)
+{
+	while(n--)class_remove_file(tb6612_class, &pid_attrs[n]);
+}
+
 static int __init tb6612_init(void)
 {
+	int i;
+
 	/* create entried in sysfs */
 	tb6612_class = class_create(THIS_MODULE, "tb6612");
 	if(tb6612_class == NULL){
@@ -164,28 +835,11 @@ static int __init tb6612_init(void)
 		return -1;
 	}
 	
-	if(class_create_file(tb6612_class, &motora_speed_attr) != 0){
-		printk(KERN_ERR "%s: Cannot create sysfs attribute\n", DRVNAME);
+	if(direct_gpio && am335x_gpio_map(&gpio_regs) != 0){
+		printk(KERN_ERR "%s: Cannot map GPIO registers\n", DRVNAME);
 		goto err1;
 	}
-	
-	if(class_create_file(tb6612_class, &motorb_speed_attr) != 0){
-		printk(KERN_ERR "%s: Cannot create sysfs attribute\n", DRVNAME);
-		goto err2;
-	}
-	if(class_create_file(tb6612_class, &motora_mode_attr) != 0){
-		printk(KERN_ERR "%s: Cannot create sysfs attribute\n", DRVNAME);
-		goto err3;
-	}
-	if(class_create_file(tb6612_class, &motorb_mode_attr) != 0){
-		printk(KERN_ERR "%s: Cannot create sysfs attribute\n", DRVNAME);
-		goto err4;
-	}
-	if(class_create_file(tb6612_class, &tb6612_standby_attr) != 0){
-		printk(KERN_ERR "%s: Cannot create sysfs attribute\n", DRVNAME);
-		goto err5;
-	}
-	
+
 	/* configure gpio and pwm outputs */
 	/* Motor A direction regulation */
 	gpio_request(AIN1, "motora_in1");
@@ -215,9 +869,9 @@ static int __init tb6612_init(void)
 	if(motora_pwm == NULL)
 	{
 		printk(KERN_ERR "%s: Cannot use PWM output P8_13\n", DRVNAME);
-		goto err6;
+		goto err2;
 	}
-	pwm_config(motora_pwm, motora_speed * MOTOR_PWM_DUTY_MUL, MOTOR_PWM_PERIOD);
+	pwm_config(motora_pwm, motor_duty[0], motor_period);
 	pwm_set_polarity(motora_pwm, PWM_POLARITY_NORMAL);
 	pwm_enable(motora_pwm);
 	
@@ -226,9 +880,9 @@ static int __init tb6612_init(void)
 	if(motorb_pwm == NULL)
 	{
 		printk(KERN_ERR "%s: Cannot use PWM output P8_19\n", DRVNAME);
-		goto err7;
+		goto err3;
 	}
-	pwm_config(motorb_pwm, motorb_speed * MOTOR_PWM_DUTY_MUL, MOTOR_PWM_PERIOD);
+	pwm_config(motorb_pwm, motor_duty[1], motor_period);
 	pwm_set_polarity(motorb_pwm, PWM_POLARITY_NORMAL);
 	pwm_enable(motorb_pwm);
 	
@@ -236,12 +890,94 @@ static int __init tb6612_init(void)
 	strcpy(motora_mode, "stop");
 	strcpy(motorb_mode, "stop");
 
+	/* the attributes below wake it up, so it has to run first */
+	control_task = kthread_run(control_thread, NULL, "tb6612");
+	if(IS_ERR(control_task)){
+		printk(KERN_ERR "%s: Cannot start the speed loop\n", DRVNAME);
+		goto err4;
+	}
+
+	/* /dev/tb6612, both bridges in one command */
+	setpoints = (struct tb6612_setpoints *)get_zeroed_page(GFP_KERNEL);
+	if(setpoints == NULL){
+		printk(KERN_ERR "%s: Cannot allocate the setpoint page\n", DRVNAME);
+		goto err5;
+	}
+
+	if(class_create_file(tb6612_class, &motora_speed_attr) != 0){
+		printk(KERN_ERR "%s: Cannot create sysfs attribute\n", DRVNAME);
+		goto err6;
+	}
+	
+	if(class_create_file(tb6612_class, &motorb_speed_attr) != 0){
+		printk(KERN_ERR "%s: Cannot create sysfs attribute\n", DRVNAME);
+		goto err7;
+	}
+	if(class_create_file(tb6612_class, &motora_mode_attr) != 0){
+		printk(KERN_ERR "%s: Cannot create sysfs attribute\n", DRVNAME);
+		goto err8;
+	}
+	if(class_create_file(tb6612_class, &motorb_mode_attr) != 0){
+		printk(KERN_ERR "%s: Cannot create sysfs attribute\n", DRVNAME);
+		goto err9;
+	}
+	if(class_create_file(tb6612_class, &tb6612_standby_attr) != 0){
+		printk(KERN_ERR "%s: Cannot create sysfs attribute\n", DRVNAME);
+		goto err10;
+	}
+	for(i = 0; i < ARRAY_SIZE(pid_attrs); i++){
+		if(class_create_file(tb6612_class, &pid_attrs[i]) != 0){
+			printk(KERN_ERR "%s: Cannot create sysfs attribute\n", DRVNAME);
+			pid_attrs_remove(i);
+			goto err11;
+		}
+	}
+
+	if(alloc_chrdev_region(&tb6612_devt, 0, 1, "tb6612") < 0){
+		printk(KERN_ERR "%s: alloc_chrdev_region failed\n", DRVNAME);
+		goto err12;
+	}
+	cdev_init(&tb6612_cdev, &tb6612_fops);
+	if(cdev_add(&tb6612_cdev, tb6612_devt, 1) != 0){
+		printk(KERN_ERR "%s: cdev_add failed\n", DRVNAME);
+		goto err13;
+	}
+	tb6612_dev = device_create(tb6612_class, NULL, tb6612_devt, NULL, "tb6612");
+	if(IS_ERR(tb6612_dev)){
+		printk(KERN_ERR "%s: Cannot create device\n", DRVNAME);
+		goto err14;
+	}
+
 	return 0;
+	err14:
+	cdev_del(&tb6612_cdev);
+	err13:
+	unregister_chrdev_region(tb6612_devt, 1);
+	err12:
+	pid_attrs_remove(ARRAY_SIZE(pid_attrs));
+	err11:
+	class_remove_file(tb6612_class, &tb6612_standby_attr);
+	err10:
+	class_remove_file(tb6612_class, &motorb_mode_attr);
+	err9:
+	class_remove_file(tb6612_class, &motora_mode_attr);
+	err8:
+	class_remove_file(tb6612_class, &motorb_speed_attr);
 	err7:
+	class_remove_file(tb6612_class, &motora_speed_attr);
+	err6:
+	free_page((unsigned long)setpoints);
+	err5:
+	kthread_stop(control_task);
+	err4:
+	pwm_config(motorb_pwm, 0, 0);
+	pwm_disable(motorb_pwm);
+	pwm_free(motorb_pwm);
+	err3:
 	pwm_config(motora_pwm, 0, 0);
 	pwm_disable(motora_pwm);
 	pwm_free(motora_pwm);
-	err6:
+	err2:
 	gpio_set_value(STDBY, 0);
 	gpio_unexport(STDBY);
 	gpio_free(STDBY);
@@ -257,25 +993,33 @@ static int __init tb6612_init(void)
 	gpio_set_value(AIN1, 0);
 	gpio_unexport(AIN1);
 	gpio_free(AIN1);
-	class_remove_file(tb6612_class, &tb6612_standby_attr);
-	err5:
-	class_remove_file(tb6612_class, &motorb_mode_attr);
-	err4:
-	class_remove_file(tb6612_class, &motora_mode_attr);
-	err3:
-	class_remove_file(tb6612_class, &motorb_speed_attr);
-	err2:
-	class_remove_file(tb6612_class, &motora_speed_attr);
+	if(direct_gpio)am335x_gpio_unmap(&gpio_regs);
 	err1:
 	class_destroy(tb6612_class);
 	return -1;
 }
-
 static void __exit tb6612_exit(void)
 {
-	pwm_config(motorb_pwm, 0, 0);
-	pwm_disable(motorb_pwm);
-	pwm_free(motorb_pwm);
+	device_destroy(tb6612_class, tb6612_devt);
+	cdev_del(&tb6612_cdev);
+	unregister_chrdev_region(tb6612_devt, 1);
+
+	pid_attrs_remove(ARRAY_SIZE(pid_attrs));
+	class_remove_file(tb6612_class, &tb6612_standby_attr);
+	class_remove_file(tb6612_class, &motorb_mode_attr);
+	class_remove_file(tb6612_class, &motora_mode_attr);
+	class_remove_file(tb6612_class, &motorb_speed_attr);
+	class_remove_file(tb6612_class, &motora_speed_attr);
+
+	kthread_stop(control_task);
+	free_page((unsigned long)setpoints);
+	if(encoder_edges)symbol_put(dagu_encoder_edges);
+
+	if(motorb_pwm != NULL){
+		pwm_config(motorb_pwm, 0, 0);
+		pwm_disable(motorb_pwm);
+		pwm_free(motorb_pwm);
+	}
 
 	pwm_config(motora_pwm, 0, 0);
 	pwm_disable(motora_pwm);
@@ -301,11 +1045,8 @@ static void __exit tb6612_exit(void)
 	gpio_unexport(AIN1);
 	gpio_free(AIN1);
 
-	class_remove_file(tb6612_class, &tb6612_standby_attr);
-	class_remove_file(tb6612_class, &motorb_mode_attr);
-	class_remove_file(tb6612_class, &motora_mode_attr);
-	class_remove_file(tb6612_class, &motorb_speed_attr);
-	class_remove_file(tb6612_class, &motora_speed_attr);
+	if(direct_gpio)am335x_gpio_unmap(&gpio_regs);
+
 	class_destroy(tb6612_class);
 }
 
@@ -0,0 +1,66 @@
+#ifndef TB6612_H
+#define TB6612_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define TB6612_STOP 0
+#define TB6612_CW 1
+#define TB6612_CCW 2
+/* IN1 = IN2 = 1, the outputs shorted together */
+#define TB6612_BRAKE 3
+
+/* flags, the parts of a command that are applied */
+#define TB6612_MOTOR_A 0x01
+#define TB6612_MOTOR_B 0x02
+#define TB6612_STANDBY 0x04
+
+struct tb6612_motor {
+	__u8 mode;	/* TB6612_STOP (coast), TB6612_CW, TB6612_CCW or TB6612_BRAKE */
+	__u8 reserved[3];
+	__u32 duty;	/* ns, up to the motor period (period, 10 ms) */
+} __attribute__((packed));
+
+/* record written to /dev/tb6612 or passed to TB6612_IOC_SET, both bridges
+ * change together, or ramp together under the accel and decel slew
+ * limits; motor[0] is A, motor[1] is B */
+struct tb6612_command {
+	__u8 flags;
+	__u8 standby;	/* 1 - outputs off */
+	__u16 reserved;
+	struct tb6612_motor motor[2];
+} __attribute__((packed));
+
+/* the page mmap()ed from /dev/tb6612, offset 0 and one page long. The
+ * driver takes cmd on its control ticks (pid_rate) whenever seq changed
+ * and is even, so a command costs the controller only memory stores:
+ * seq++ (odd), write cmd, seq++ (even), with barriers in between, see
+ * tb6612_setpoints_begin()/end(). A block seen torn is taken next tick. */
+struct tb6612_setpoints {
+	__u32 seq;	/* written by userspace only */
+	__u32 applied;	/* driver, seq of the last command taken */
+	__s32 status;	/* driver, 0 or -errno of that command */
+	__u32 reserved;
+	struct tb6612_command cmd;
+} __attribute__((packed));
+
+#ifndef __KERNEL__
+static inline void tb6612_setpoints_begin(volatile struct tb6612_setpoints *sp)
+{
+	sp->seq++;
+	__sync_synchronize();
+}
+
+static inline void tb6612_setpoints_end(volatile struct tb6612_setpoints *sp)
+{
+	__sync_synchronize();
+	sp->seq++;
+}
+#endif
+
+#define TB6612_IOC_MAGIC 't'
+#define TB6612_IOC_SET _IOW(TB6612_IOC_MAGIC, 1, struct tb6612_command)
+/* all flags set, the state both bridges are driven with now */
+#define TB6612_IOC_GET _IOR(TB6612_IOC_MAGIC, 2, struct tb6612_command)
+
+#endif
@@ -0,0 +1,66 @@
+.origin 0
+.entrypoint START
+
+// step segment ring in PRU data RAM, filled by the a4988 kernel module
+// head is written by the ARM, tail and the position by the PRU
+#define RING_HEAD 0x00
+#define RING_TAIL 0x04
+#define RING_POSITION 0x08  // low 32 bits of the axis position
+#define RING_BASE 0x10
+#define RING_LEN 256
+#define ENTRY_SHIFT 4       // 16 bytes: steps, high loops, low loops, position increment
+
+// STEP is r30.t5 (P9_27), DIR is r30.t7 (P9_25)
+// every delay loop iteration takes 2 instructions, 10ns
+#define DIR_SETUP_LOOPS 24  // 240ns, the A4988 wants 200ns of DIR before STEP
+
+START:
+    MOV r0, 0x00000000      //data ram base
+    LBBO r1, r0, RING_TAIL, 4
+    LBBO r9, r0, RING_POSITION, 4
+
+IDLE:
+    LBBO r2, r0, RING_HEAD, 4
+    QBEQ IDLE, r2, r1       //wait till ARM queues a segment
+
+    //load entry at tail, r4 - steps, r5 - high loops, r6 - low loops,
+    //r7 - signed position increment per step, negative is ccw
+    LSL r3, r1, ENTRY_SHIFT
+    ADD r3, r3, RING_BASE
+    LBBO r4, r3, 0, 16
+    //DIR is only written when it changes, then held 200ns before STEP
+    QBBS DIR_CCW, r7.t31
+    QBBC STEPPING, r30.t7
+    CLR r30.t7
+    QBA DIR_SETUP
+DIR_CCW:
+    QBBS STEPPING, r30.t7
+    SET r30.t7
+DIR_SETUP:
+    MOV r8, DIR_SETUP_LOOPS
+DIR_WAIT:
+    SUB r8, r8, 1
+    QBNE DIR_WAIT, r8, 0
+
+STEPPING:
+    QBEQ NEXT, r4, 0
+    SET r30.t5              //STEP rising edge
+    MOV r8, r5
+HIGH:
+    SUB r8, r8, 1
+    QBNE HIGH, r8, 0
+    CLR r30.t5              //STEP falling edge
+    MOV r8, r6
+LOW:
+    SUB r8, r8, 1
+    QBNE LOW, r8, 0
+    SUB r4, r4, 1
+    ADD r9, r9, r7
+    SBBO r9, r0, RING_POSITION, 4
+    QBA STEPPING
+
+NEXT:
+    ADD r1, r1, 1
+    AND r1, r1, RING_LEN - 1
+    SBBO r1, r0, RING_TAIL, 4
+    QBA IDLE
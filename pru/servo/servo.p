@@ -0,0 +1,170 @@
+.origin 0
+.entrypoint START
+
+// pulse table in PRU shared RAM, written by the servo kernel module
+// the ARM bumps seq to odd, writes, bumps it to even; a frame only takes
+// a table seen with the same even seq before and after, else the last one
+#define TABLE_SEQ 0x00
+#define TABLE_ENABLE 0x04   // r30 bits driven, the rest stay low
+#define TABLE_PERIOD 0x08   // us, length of a frame
+#define TABLE_FRAMES 0x0c   // frames started, written by the PRU
+#define TABLE_WIDTH 0x10    // 16 pulse widths in us, for r30.t0 - r30.t15
+#define TABLE_SIZE 76       // enable to the last width
+
+// a frame is PERIOD ticks of 1us, every tick is 200 instructions:
+// 3 per channel whether it is high or low, the rest in the delay loop
+#define INS_PER_US 200
+#define INS_PER_LOOP 2
+#define INS_PER_CHANNEL 3
+#define TICK_OVERHEAD 4
+#define TICK_LOOPS (INS_PER_US - 16 * INS_PER_CHANNEL - TICK_OVERHEAD) / INS_PER_LOOP
+
+// r10 - enable, r11 - period, r12 - unused, r13 - r28 widths counting down
+
+START:
+    MOV r0, 0x00010000      //shared ram base
+    MOV r6, 0x00000000      //data ram base, last table taken
+    MOV r5, 0
+    MOV r30.w0, 0
+
+FRAME:
+    LBBO r3, r0, TABLE_SEQ, 4
+    QBBS KEEP, r3.t0        //ARM half way through a write
+    LBBO r10, r0, TABLE_ENABLE, TABLE_SIZE
+    LBBO r4, r0, TABLE_SEQ, 4
+    QBNE KEEP, r4, r3
+    SBBO r10, r6, 0, TABLE_SIZE
+    QBA LOADED
+KEEP:
+    LBBO r10, r6, 0, TABLE_SIZE
+LOADED:
+    QBNE RUN, r11, 0
+    MOV r30.w0, 0           //no period yet, outputs low
+    QBA FRAME
+RUN:
+    ADD r5, r5, 1
+    SBBO r5, r0, TABLE_FRAMES, 4
+    MOV r2, r11
+    MOV r30.w0, r10.w0      //rising edges of every enabled channel
+
+TICK:
+    QBEQ OFF0, r13, 0
+    SUB r13, r13, 1
+    QBA NEXT0
+OFF0:
+    CLR r30.t0
+    QBA NEXT0             //same 3 instructions both ways
+NEXT0:
+    QBEQ OFF1, r14, 0
+    SUB r14, r14, 1
+    QBA NEXT1
+OFF1:
+    CLR r30.t1
+    QBA NEXT1
+NEXT1:
+    QBEQ OFF2, r15, 0
+    SUB r15, r15, 1
+    QBA NEXT2
+OFF2:
+    CLR r30.t2
+    QBA NEXT2
+NEXT2:
+    QBEQ OFF3, r16, 0
+    SUB r16, r16, 1
+    QBA NEXT3
+OFF3:
+    CLR r30.t3
+    QBA NEXT3
+NEXT3:
+    QBEQ OFF4, r17, 0
+    SUB r17, r17, 1
+    QBA NEXT4
+OFF4:
+    CLR r30.t4
+    QBA NEXT4
+NEXT4:
+    QBEQ OFF5, r18, 0
+    SUB r18, r18, 1
+    QBA NEXT5
+OFF5:
+    CLR r30.t5
+    QBA NEXT5
+NEXT5:
+    QBEQ OFF6, r19, 0
+    SUB r19, r19, 1
+    QBA NEXT6
+OFF6:
+    CLR r30.t6
+    QBA NEXT6
+NEXT6:
+    QBEQ OFF7, r20, 0
+    SUB r20, r20, 1
+    QBA NEXT7
+OFF7:
+    CLR r30.t7
+    QBA NEXT7
+NEXT7:
+    QBEQ OFF8, r21, 0
+    SUB r21, r21, 1
+    QBA NEXT8
+OFF8:
+    CLR r30.t8
+    QBA NEXT8
+NEXT8:
+    QBEQ OFF9, r22, 0
+    SUB r22, r22, 1
+    QBA NEXT9
+OFF9:
+    CLR r30.t9
+    QBA NEXT9
+NEXT9:
+    QBEQ OFF10, r23, 0
+    SUB r23, r23, 1
+    QBA NEXT10
+OFF10:
+    CLR r30.t10
+    QBA NEXT10
+NEXT10:
+    QBEQ OFF11, r24, 0
+    SUB r24, r24, 1
+    QBA NEXT11
+OFF11:
+    CLR r30.t11
+    QBA NEXT11
+NEXT11:
+    QBEQ OFF12, r25, 0
+    SUB r25, r25, 1
+    QBA NEXT12
+OFF12:
+    CLR r30.t12
+    QBA NEXT12
+NEXT12:
+    QBEQ OFF13, r26, 0
+    SUB r26, r26, 1
+    QBA NEXT13
+OFF13:
+    CLR r30.t13
+    QBA NEXT13
+NEXT13:
+    QBEQ OFF14, r27, 0
+    SUB r27, r27, 1
+    QBA NEXT14
+OFF14:
+    CLR r30.t14
+    QBA NEXT14
+NEXT14:
+    QBEQ OFF15, r28, 0
+    SUB r28, r28, 1
+    QBA NEXT15
+OFF15:
+    CLR r30.t15
+    QBA NEXT15
+NEXT15:
+    SUB r2, r2, 1
+    MOV r1, TICK_LOOPS
+    MOV r1, r1              //pads the tick to an even count
+DELAY:
+    SUB r1, r1, 1
+    QBNE DELAY, r1, 0
+    QBNE TICK, r2, 0
+    QBA FRAME